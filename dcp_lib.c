@@ -7,18 +7,130 @@
 static dataInfo Data[BUFF];
 static confInfo Conf;
 static execInfo Exec;
+static preHashInfo PreHash;
 
-int getIdx( int varId, dataInfo *Data )
+int getIdx( int varId, dataInfo *Data, int nbVar )
 {
     int i=0;
-    for(; i<Exec.nbVar; i++) {
+    for(; i<nbVar; i++) {
         if(Data[i].id == varId) break;
     }
-    if( i==Exec.nbVar ) {
+    if( i==nbVar ) {
         return -1;
     }
     return i;
 }
+//----------------------------------------------------------------------------------------------
+// PRE-HASHING
+//----------------------------------------------------------------------------------------------
+
+// hashes blocks [first,last) of dataset 'idx' ahead of the next checkpoint.
+static void preHashBlocks( int idx, unsigned long first, unsigned long last, unsigned long stamp, unsigned char *block )
+{
+    dataInfo *data = &Data[idx];
+    unsigned long b;
+    for(b=first; b<last; b++) {
+        unsigned long pos = b*Conf.dcpBlockSize;
+        unsigned char *ptr = data->ptr + pos;
+        if( (data->size-pos) < Conf.dcpBlockSize ) {
+            // if block smaller pad with zeros
+            memset( block, 0x0, Conf.dcpBlockSize );
+            memcpy( block, ptr, data->size-pos );
+            ptr = block;
+        }
+        Conf.hashFunc( ptr, Conf.dcpBlockSize, &data->preHashArray[b*Conf.digestWidth] );
+        data->preHashStamp[b] = stamp;
+    }
+}
+
+static void* preHashThread( void *arg )
+{
+    unsigned char *block = (unsigned char*) malloc( Conf.dcpBlockSize );
+    
+    pthread_mutex_lock( &PreHash.lock );
+    while( true ) {
+        while( (PreHash.nbJobs == 0) && !PreHash.shutdown ) {
+            pthread_cond_wait( &PreHash.cond, &PreHash.lock );
+        }
+        if( PreHash.shutdown ) break;
+        preHashJob job = PreHash.queue[PreHash.head];
+        PreHash.head = (PreHash.head + 1) % PreHash.maxJobs;
+        PreHash.nbJobs--;
+        PreHash.busy = true;
+        PreHash.busyIdx = job.idx;
+        pthread_mutex_unlock( &PreHash.lock );
+        
+        preHashBlocks( job.idx, job.first, job.last, job.stamp, block );
+        
+        pthread_mutex_lock( &PreHash.lock );
+        PreHash.busy = false;
+        pthread_cond_broadcast( &PreHash.cond );
+    }
+    pthread_mutex_unlock( &PreHash.lock );
+    
+    free(block);
+    return NULL;
+}
+
+static void enqueuePreHash( preHashJob job )
+{
+    pthread_mutex_lock( &PreHash.lock );
+    if( PreHash.nbJobs == PreHash.maxJobs ) {
+        // grow ring buffer and unwrap
+        size_t maxJobs = 2*PreHash.maxJobs;
+        preHashJob *queue = (preHashJob*) malloc( sizeof(preHashJob)*maxJobs );
+        size_t j;
+        for(j=0; j<PreHash.nbJobs; j++) {
+            queue[j] = PreHash.queue[(PreHash.head + j) % PreHash.maxJobs];
+        }
+        free(PreHash.queue);
+        PreHash.queue = queue;
+        PreHash.maxJobs = maxJobs;
+        PreHash.head = 0;
+    }
+    PreHash.queue[(PreHash.head + PreHash.nbJobs) % PreHash.maxJobs] = job;
+    PreHash.nbJobs++;
+    pthread_cond_broadcast( &PreHash.cond );
+    pthread_mutex_unlock( &PreHash.lock );
+}
+
+// drops the pending pre-hash jobs of dataset 'idx' (all datasets if 'idx' < 0) and waits 
+// for a running job on it. Afterwards, the dataset and its pre-hashes can be accessed 
+// without racing the background hasher.
+static void stopPreHash( int idx )
+{
+    if( !Conf.preHashThread ) return;
+    
+    pthread_mutex_lock( &PreHash.lock );
+    if( idx < 0 ) {
+        PreHash.nbJobs = 0;
+    } else {
+        // keep the jobs of the other datasets in order
+        size_t j, nbJobs = 0;
+        for(j=0; j<PreHash.nbJobs; j++) {
+            preHashJob job = PreHash.queue[(PreHash.head + j) % PreHash.maxJobs];
+            if( job.idx == idx ) continue;
+            PreHash.queue[(PreHash.head + nbJobs) % PreHash.maxJobs] = job;
+            nbJobs++;
+        }
+        PreHash.nbJobs = nbJobs;
+    }
+    while( PreHash.busy && ((idx < 0) || (PreHash.busyIdx == idx)) ) {
+        pthread_cond_wait( &PreHash.cond, &PreHash.lock );
+    }
+    pthread_mutex_unlock( &PreHash.lock );
+}
+
+// the data of all datasets changed, e.g. on recovery.
+static void invalidatePreHashes()
+{
+    stopPreHash( -1 );
+    int i;
+    for(i=0; i<Exec.nbVar; i++) {
+        Data[i].validStamp = ++Data[i].stamp;
+    }
+}
+
 //----------------------------------------------------------------------------------------------
 // FUNCTION DEFINITIONS
 //----------------------------------------------------------------------------------------------
@@ -52,16 +164,69 @@ int init( MPI_Comm comm )
     // reset dcpStack
     Exec.dcp.dcpCounter = 0;
     Exec.dcp.dcpFileSize = 0;
+    Exec.dcp.dcpCost = 0;
+    Exec.dcp.dcpTime = MPI_Wtime();
+    Exec.dcp.dueRequest = MPI_REQUEST_NULL;
+    Exec.firstRecovery = 0;
+    Exec.lastRecovery = 0;
+    Exec.nbRecoveries = 0;
 
     // set dcp stack size to 5
     Conf.dcpStackSize = 5;
     Conf.dcpBlockSize = 16384;
+    if( (Conf.dcpSubBlockSize == 0) || (Conf.dcpBlockSize%Conf.dcpSubBlockSize != 0) || (Conf.dcpBlockSize/Conf.dcpSubBlockSize > MAX_SUBBLOCKS) ) {
+        ERR_EXT( comm, "'DCP_SUBBLOCK_SIZE' has to divide the block size '%lu' into at most %d sub-blocks", rank, Conf.dcpBlockSize, MAX_SUBBLOCKS );
+    }
+    Exec.dcp.layerSize = (unsigned long*) calloc( Conf.dcpStackSize, sizeof(unsigned long) );
+
+    crc32cInit();
+    shuffleInit();
+    
+    if( Conf.preHashThread ) {
+        PreHash.maxJobs = 64;
+        PreHash.queue = (preHashJob*) malloc( sizeof(preHashJob)*PreHash.maxJobs );
+        PreHash.head = 0;
+        PreHash.nbJobs = 0;
+        PreHash.busy = false;
+        PreHash.busyIdx = -1;
+        PreHash.shutdown = false;
+        pthread_mutex_init( &PreHash.lock, NULL );
+        pthread_cond_init( &PreHash.cond, NULL );
+        if( pthread_create( &PreHash.thread, NULL, preHashThread, NULL ) != 0 ) {
+            ERR_EXT( comm, "unable to start background hasher", rank );
+        }
+    }
 
     if( Exec.commRank == 0 ) {
         printConfiguration( Conf, Exec );
     }
 }
 
+int finalize()
+{
+    // the last decision of checkpointIfDue is not applied
+    if( Exec.dcp.dueRequest != MPI_REQUEST_NULL ) {
+        MPI_Wait( &Exec.dcp.dueRequest, MPI_STATUS_IGNORE );
+    }
+    
+    if( Conf.preHashThread ) {
+        stopPreHash( -1 );
+        pthread_mutex_lock( &PreHash.lock );
+        PreHash.shutdown = true;
+        pthread_cond_broadcast( &PreHash.cond );
+        pthread_mutex_unlock( &PreHash.lock );
+        pthread_join( PreHash.thread, NULL );
+        pthread_mutex_destroy( &PreHash.lock );
+        pthread_cond_destroy( &PreHash.cond );
+        free(PreHash.queue);
+        PreHash.queue = NULL;
+        // regions finished afterwards are hashed right away
+        Conf.preHashThread = false;
+    }
+    
+    return SCES;
+}
+
 int protect( int id, void* ptr, size_t nElem, size_t elemSize )
 {
     if( ptr == NULL ) {
@@ -73,7 +238,7 @@ int protect( int id, void* ptr, size_t nElem, size_t elemSize )
         ERR_MSG( Exec.comm, "invalid ID '%d'. ID's have to be positive.", Exec.commRank, id );
         return NSCS;
     }
-   
+
     bool update = false;
     int i;
     for( i=0; i<Exec.nbVar; i++) {
@@ -84,27 +249,340 @@ int protect( int id, void* ptr, size_t nElem, size_t elemSize )
         }
     }
     
+    // the background hasher may still read the dataset
+    if( update ) stopPreHash( i );
+    
     Data[i].elemSize = elemSize;
     Data[i].id = id;    
     Data[i].nElem = nElem;
     Data[i].ptr = ptr;
     Data[i].size = elemSize*nElem;
+    // content may have changed with the pointer
+    Data[i].touched = true;
+    if( !update ) Data[i].stamp = 0;
+    Data[i].validStamp = ++Data[i].stamp;
 
     DBG_MSG(Exec.comm, "id: %d, size: %lu, ptr: %p", 0, id, elemSize*nElem, ptr);
     if( !update ) {
         Data[i].hashDataSize = 0;
         Data[i].hashArray = NULL;
+        Data[i].subHashArray = NULL;
+        Data[i].filter = DCP_FILTER_NONE;
+        Data[i].refArray = NULL;
+        Data[i].policy = DCP_POLICY_DIFFERENTIAL;
+        Data[i].nth = 1;
+        Data[i].heatMap = NULL;
+        Data[i].nbHeatBlocks = 0;
+        Data[i].nbHashed = 0;
+        Data[i].lastDirtyBlocks = 0;
+        Data[i].totalDirtyBlocks = 0;
+        Data[i].preHashArray = NULL;
+        Data[i].preHashStamp = NULL;
+        Data[i].modStamp = NULL;
+        Data[i].nbPreHashBlocks = 0;
         Exec.nbVar++;
     }
     
     return SCES;
 }
 
+int setFilter( int id, int filter )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    if( filter & ~(DCP_FILTER_SHUFFLE | DCP_FILTER_XOR) ) {
+        ERR_MSG( Exec.comm, "invalid filter '%d' for id '%d'.", Exec.commRank, filter, id );
+        return NSCS;
+    }
+
+    Data[idx].filter = filter;
+    
+    // the next checkpoint writes all blocks, so the reference blocks of the XOR predictor are in sync.
+    Data[idx].hashDataSize = 0;
+    if( !(filter & DCP_FILTER_XOR) ) {
+        free(Data[idx].refArray);
+        Data[idx].refArray = NULL;
+    }
+
+    return SCES;
+}
+
+int setPolicy( int id, int policy, int nth )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    if( (policy < DCP_POLICY_DIFFERENTIAL) || (policy > DCP_POLICY_NTH) ) {
+        ERR_MSG( Exec.comm, "invalid policy '%d' for id '%d'.", Exec.commRank, policy, id );
+        return NSCS;
+    }
+    
+    if( (policy == DCP_POLICY_NTH) && (nth < 1) ) {
+        ERR_MSG( Exec.comm, "invalid interval '%d' for id '%d'. Interval has to be positive.", Exec.commRank, nth, id );
+        return NSCS;
+    }
+
+    Data[idx].policy = policy;
+    Data[idx].nth = ( policy == DCP_POLICY_NTH ) ? nth : 1;
+    
+    // stored hashes may be outdated, hash with the next checkpoint
+    Data[idx].touched = true;
+
+    return SCES;
+}
+
+int touch( int id )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    Data[idx].touched = true;
+
+    return SCES;
+}
+
+int getVarStats( int id, dcpVarStats *stats )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    if( stats == NULL ) {
+        ERR_MSG( Exec.comm, "invalid stats (stats == NULL).", Exec.commRank );
+        return NSCS;
+    }
+
+    stats->nbBlocks = Data[idx].size/Conf.dcpBlockSize + (bool)(Data[idx].size%Conf.dcpBlockSize);
+    stats->nbHashed = Data[idx].nbHashed;
+    stats->lastDirtyBlocks = Data[idx].lastDirtyBlocks;
+    stats->totalDirtyBlocks = Data[idx].totalDirtyBlocks;
+
+    return SCES;
+}
+
+// copies the number of hashed checkpoints each block was dirty in to 'heatMap'. Returns
+// the number of blocks copied, at most 'nbBlocks'.
+long getHeatMap( int id, unsigned int *heatMap, size_t nbBlocks )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    if( heatMap == NULL ) {
+        ERR_MSG( Exec.comm, "invalid heat map (heatMap == NULL).", Exec.commRank );
+        return NSCS;
+    }
+
+    if( nbBlocks > Data[idx].nbHeatBlocks ) nbBlocks = Data[idx].nbHeatBlocks;
+    if( nbBlocks > 0 ) {
+        memcpy( heatMap, Data[idx].heatMap, sizeof(unsigned int)*nbBlocks );
+    }
+
+    return nbBlocks;
+}
+
+// marks the region [offset,offset+len) of a dataset as final until the next checkpoint. The 
+// blocks inside the region are hashed right away, by the background hasher if enabled.
+int regionDone( int id, size_t offset, size_t len )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    dataInfo *data = &Data[idx];
+    if( (offset > data->size) || (len > data->size - offset) ) {
+        ERR_MSG( Exec.comm, "region [%lu,%lu) exceeds size of id '%d' (%lu)", Exec.commRank, offset, offset+len, id, data->size );
+        return NSCS;
+    }
+   
+    unsigned long nbBlocks = data->size/Conf.dcpBlockSize + (bool)(data->size%Conf.dcpBlockSize);
+    if( data->nbPreHashBlocks != nbBlocks ) {
+        stopPreHash( idx );
+        data->preHashArray = (unsigned char*) realloc( data->preHashArray, nbBlocks*Conf.digestWidth );
+        data->preHashStamp = (unsigned long*) realloc( data->preHashStamp, sizeof(unsigned long)*nbBlocks );
+        data->modStamp = (unsigned long*) realloc( data->modStamp, sizeof(unsigned long)*nbBlocks );
+        memset( data->preHashStamp, 0x0, sizeof(unsigned long)*nbBlocks );
+        memset( data->modStamp, 0x0, sizeof(unsigned long)*nbBlocks );
+        data->nbPreHashBlocks = nbBlocks;
+    }
+
+    // blocks completely inside the region, the last block of the dataset may be partial
+    unsigned long first = offset/Conf.dcpBlockSize + (bool)(offset%Conf.dcpBlockSize);
+    unsigned long last = ( (offset+len) == data->size ) ? nbBlocks : (offset+len)/Conf.dcpBlockSize;
+    
+    unsigned char *block = ( Conf.preHashThread ) ? NULL : (unsigned char*) malloc( Conf.dcpBlockSize );
+    for(; first < last; first += PREHASH_JOB_BLOCKS) {
+        preHashJob job;
+        job.idx = idx;
+        job.first = first;
+        job.last = ( (last-first) < PREHASH_JOB_BLOCKS ) ? last : first + PREHASH_JOB_BLOCKS;
+        job.stamp = ++data->stamp;
+        if( Conf.preHashThread ) {
+            enqueuePreHash( job );
+        } else {
+            preHashBlocks( job.idx, job.first, job.last, job.stamp, block );
+        }
+    }
+    free(block);
+
+    return SCES;
+}
+
+// invalidates the pre-hashes of the blocks overlapping [offset,offset+len).
+int regionModified( int id, size_t offset, size_t len )
+{
+    int idx = getIdx( id, Data, Exec.nbVar );
+    if( idx < 0 ) {
+        ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, id );
+        return NSCS;
+    }
+    
+    dataInfo *data = &Data[idx];
+    if( (len == 0) || (data->nbPreHashBlocks == 0) ) return SCES;
+
+    unsigned long first = offset/Conf.dcpBlockSize;
+    unsigned long last = (offset+len-1)/Conf.dcpBlockSize;
+    if( last >= data->nbPreHashBlocks ) last = data->nbPreHashBlocks-1;
+    unsigned long stamp = ++data->stamp;
+    for(; first <= last; first++) {
+        data->modStamp[first] = stamp;
+    }
+
+    return SCES;
+}
+
+//----------------------------------------------------------------------------------------------
+// CHECKPOINT HELPERS
+//----------------------------------------------------------------------------------------------
+
+// hashes the sub-blocks of a block and returns the mask of sub-blocks that changed since 
+// the last checkpoint. The stored hashes are updated. Sub-blocks are hashed with the block 
+// hash function, a collision must not drop a changed sub-block.
+static uint64_t subBlockDiff( dataInfo *data, unsigned long blockId, unsigned char *ptr, bool compare )
+{
+    unsigned int nbSub = Conf.dcpBlockSize / Conf.dcpSubBlockSize;
+    uint64_t fullMask = ( nbSub == MAX_SUBBLOCKS ) ? ~0UL : (1UL << nbSub) - 1;
+    unsigned char *hash = &data->subHashArray[blockId*nbSub*Conf.digestWidth];
+    unsigned char h[MD5_DIGEST_LENGTH];
+    uint64_t mask = 0;
+    unsigned int s;
+    for(s=0; s<nbSub; s++, hash += Conf.digestWidth) {
+        Conf.hashFunc( ptr + s*Conf.dcpSubBlockSize, Conf.dcpSubBlockSize, h );
+        if( !compare || memcmp( h, hash, Conf.digestWidth ) ) mask |= (1UL << s);
+        memcpy( hash, h, Conf.digestWidth );
+    }
+    // block hash changed but fingerprints did not (collision), write whole block.
+    return ( mask == 0 ) ? fullMask : mask;
+}
+
+// applies the filters of a dataset to a block and compresses the result. 'work' has to 
+// hold 2*dcpBlockSize + compressBound(dcpBlockSize) bytes. Returns the record filter 
+// flags, 'payload' and 'length' receive the encoded block.
+static unsigned char filterBlock( dataInfo *data, unsigned long blockId, unsigned char *ptr, bool hasRef, unsigned char *work, unsigned char **payload, uint32_t *length )
+{
+    unsigned char flags = 0;
+    unsigned char *src = ptr;
+    
+    if( data->filter & DCP_FILTER_XOR ) {
+        unsigned char *ref = data->refArray + blockId*Conf.dcpBlockSize;
+        if( hasRef ) {
+            memcpy( work, ptr, Conf.dcpBlockSize );
+            xorBlock( work, ref, Conf.dcpBlockSize );
+            src = work;
+            flags |= DCP_FILTER_XOR;
+        }
+        memcpy( ref, ptr, Conf.dcpBlockSize );
+    }
+    if( (data->filter & DCP_FILTER_SHUFFLE) && (data->elemSize > 1) ) {
+        shuffle( src, work + Conf.dcpBlockSize, Conf.dcpBlockSize, data->elemSize );
+        src = work + Conf.dcpBlockSize;
+        flags |= DCP_FILTER_SHUFFLE;
+    }
+    
+    unsigned char *cbuf = work + 2*Conf.dcpBlockSize;
+    uLongf clen = compressBound( Conf.dcpBlockSize );
+    if( (compress2( cbuf, &clen, src, Conf.dcpBlockSize, Z_BEST_SPEED ) == Z_OK) && (clen < Conf.dcpBlockSize) ) {
+        *payload = cbuf;
+        *length = clen;
+        flags |= RECORD_COMPRESSED;
+    } else {
+        *payload = src;
+        *length = Conf.dcpBlockSize;
+    }
+
+    return flags;
+}
+
+// writes a block record: [meta (6 bytes)][sub-block mask][filter][length][payload][crc32c]
+// unfiltered blocks store the changed sub-blocks of 'ptr', filtered blocks 'length' bytes.
+// returns the number of bytes written or 0 on failure.
+static unsigned long writeRecord( FILE *fd, blockMetaInfo_t *blockMeta, uint64_t mask, unsigned char filter, unsigned char *ptr, uint32_t length )
+{
+    unsigned int nbSub = Conf.dcpBlockSize / Conf.dcpSubBlockSize;
+    unsigned long written = 0;
+    uint32_t crc = crc32cUpdate( 0, (unsigned char*)blockMeta, 6 );
+    crc = crc32cUpdate( crc, (unsigned char*)&mask, sizeof(uint64_t) );
+    crc = crc32cUpdate( crc, &filter, 1 );
+    crc = crc32cUpdate( crc, (unsigned char*)&length, sizeof(uint32_t) );
+    
+    if( !fwrite( blockMeta, 6, 1, fd ) ) return 0;
+    if( !fwrite( &mask, sizeof(uint64_t), 1, fd ) ) return 0;
+    if( !fwrite( &filter, 1, 1, fd ) ) return 0;
+    if( !fwrite( &length, sizeof(uint32_t), 1, fd ) ) return 0;
+    written += RECORD_HEADER_SIZE;
+    
+    if( filter != DCP_FILTER_NONE ) {
+        crc = crc32cUpdate( crc, ptr, length );
+        if( !fwrite( ptr, length, 1, fd ) ) return 0;
+        written += length;
+        nbSub = 0;
+    }
+    
+    // write runs of consecutive changed sub-blocks at once
+    unsigned int s = 0;
+    while( s < nbSub ) {
+        if( !(mask & (1UL << s)) ) {
+            s++;
+            continue;
+        }
+        unsigned int e = s;
+        while( (e < nbSub) && (mask & (1UL << e)) ) e++;
+        unsigned long len = (e-s)*Conf.dcpSubBlockSize;
+        crc = crc32cUpdate( crc, ptr + s*Conf.dcpSubBlockSize, len );
+        if( !fwrite( ptr + s*Conf.dcpSubBlockSize, len, 1, fd ) ) return 0;
+        written += len;
+        s = e;
+    }
+
+    if( !fwrite( &crc, CRC32_DIGEST_LENGTH, 1, fd ) ) return 0;
+    
+    return written + CRC32_DIGEST_LENGTH;
+}
+
 int checkpoint( int id )
 {
     MPI_Barrier(Exec.comm);
     double t1 = MPI_Wtime();
     
+    // pending regions are hashed below
+    stopPreHash( -1 );
+    
     if( id < 0 ) {
         ERR_MSG( Exec.comm, "invalid ID '%d'. ID's have to be positive.", Exec.commRank, id );
         return NSCS;
@@ -137,6 +615,7 @@ int checkpoint( int id )
     }
 
     unsigned char * block = (unsigned char*) malloc( Conf.dcpBlockSize );
+    unsigned char * work = (unsigned char*) malloc( 2*Conf.dcpBlockSize + compressBound( Conf.dcpBlockSize ) );
     int i = 0;
     
     size_t dcpSize = 0;
@@ -160,8 +639,47 @@ int checkpoint( int id )
             return NSCS;
         }
         
+        // checkpoint policy of the dataset
+        bool doHash = true;
+        bool doWrite = true;
+        bool hashValid = (Data[i].hashArray != NULL) && (Data[i].hashDataSize == dataSize);
+        switch( Data[i].policy ) {
+            case DCP_POLICY_STATIC:
+                if( hashValid && !Data[i].touched ) {
+                    doHash = false;
+                    doWrite = (dcpLayer == 0);
+                }
+                break;
+            case DCP_POLICY_FULL:
+                doHash = false;
+                break;
+            case DCP_POLICY_NTH:
+                if( hashValid && (dcpLayer > 0) && (Exec.dcp.dcpCounter % Data[i].nth != 0) ) {
+                    doHash = false;
+                    doWrite = false;
+                }
+                break;
+        }
+        if( !doWrite ) continue;
+        
+        // base layer is written completely and without reference to earlier layers
+        unsigned long refSize = ( (dcpLayer == 0) || !doHash ) ? 0 : Data[i].hashDataSize;
+        
         // allocate tmp hash array
-        Data[i].hashArrayTmp = (unsigned char*) malloc( sizeof(unsigned char)*nbHashes*Conf.digestWidth );
+        if( doHash ) {
+            Data[i].hashArrayTmp = (unsigned char*) malloc( sizeof(unsigned char)*nbHashes*Conf.digestWidth );
+            if( Data[i].nbHeatBlocks < nbHashes ) {
+                Data[i].heatMap = (unsigned int*) realloc( Data[i].heatMap, sizeof(unsigned int)*nbHashes );
+                memset( Data[i].heatMap + Data[i].nbHeatBlocks, 0x0, sizeof(unsigned int)*(nbHashes-Data[i].nbHeatBlocks) );
+                Data[i].nbHeatBlocks = nbHashes;
+            }
+            Data[i].nbHashed++;
+            Data[i].lastDirtyBlocks = 0;
+        }
+        Data[i].subHashArray = (unsigned char*) realloc( Data[i].subHashArray, nbHashes*(Conf.dcpBlockSize/Conf.dcpSubBlockSize)*Conf.digestWidth );
+        if( Data[i].filter & DCP_FILTER_XOR ) {
+            Data[i].refArray = (unsigned char*) realloc( Data[i].refArray, nbHashes*Conf.dcpBlockSize );
+        }
         
         // create meta data buffer
         blockMetaInfo_t blockMeta;
@@ -197,43 +715,61 @@ int checkpoint( int id )
 
             unsigned int chunkSize = ( (dataSize-pos) < Conf.dcpBlockSize ) ? dataSize-pos : Conf.dcpBlockSize;
            
-            // compute hashes
             if( chunkSize < Conf.dcpBlockSize ) {
                 // if block smaller pad with zeros
                 memset( block, 0x0, Conf.dcpBlockSize );
                 memcpy( block, ptr, chunkSize );
-                Conf.hashFunc( block, Conf.dcpBlockSize, &Data[i].hashArrayTmp[hashIdx] );
                 ptr = block;
                 chunkSize = Conf.dcpBlockSize;
                 //DBG_MSG(Exec.comm, "yepp",0);
-            } else {
-                Conf.hashFunc( ptr, Conf.dcpBlockSize, &Data[i].hashArrayTmp[hashIdx] );
-                char hashstring[Conf.digestWidth*2+1];
-                //if(i==1)//DBG_MSG(Exec.comm, "ptr: %p, hash: %s", 0, ptr, hashHex(&Data[i].hashArrayTmp[hashIdx], Conf.digestWidth, hashstring));
             }
             
-            bool commitBlock;
-            // if old hash exists, compare. If datasize increased, there wont be an old hash to compare with.
-            if( pos < Data[i].hashDataSize ) {
-                commitBlock = memcmp( &Data[i].hashArray[hashIdx], &Data[i].hashArrayTmp[hashIdx], Conf.digestWidth );
-                //if(i==1) //DBG_MSG(Exec.comm, "hash compare, commitBlock:%d, Data[%d]:%d", 0, commitBlock, intIdx, ((int*)Data[i].ptr)[intIdx] );
-            } else {
-                commitBlock = true;
+            bool commitBlock = true;
+            if( doHash ) {
+                bool preHashed = (Data[i].nbPreHashBlocks == nbHashes)
+                    && (Data[i].preHashStamp[blockId] > Data[i].modStamp[blockId]) 
+                    && (Data[i].preHashStamp[blockId] > Data[i].validStamp);
+                if( preHashed ) {
+                    memcpy( &Data[i].hashArrayTmp[hashIdx], &Data[i].preHashArray[blockId*Conf.digestWidth], Conf.digestWidth );
+                } else {
+                    Conf.hashFunc( ptr, Conf.dcpBlockSize, &Data[i].hashArrayTmp[hashIdx] );
+                }
+                char hashstring[Conf.digestWidth*2+1];
+                //if(i==1)//DBG_MSG(Exec.comm, "ptr: %p, hash: %s", 0, ptr, hashHex(&Data[i].hashArrayTmp[hashIdx], Conf.digestWidth, hashstring));
+                
+                // if old hash exists, compare. If datasize increased, there wont be an old hash to compare with.
+                bool dirty = true;
+                if( pos < Data[i].hashDataSize ) {
+                    dirty = memcmp( &Data[i].hashArray[hashIdx], &Data[i].hashArrayTmp[hashIdx], Conf.digestWidth );
+                    //if(i==1) //DBG_MSG(Exec.comm, "hash compare, commitBlock:%d, Data[%d]:%d", 0, commitBlock, intIdx, ((int*)Data[i].ptr)[intIdx] );
+                }
+                if( dirty ) {
+                    Data[i].heatMap[blockId]++;
+                    Data[i].lastDirtyBlocks++;
+                }
+                commitBlock = dirty || (pos >= refSize);
             }
 
             bool success = true;
-            int fileUpdate = 0;
             if( commitBlock ) {
-                if( dcpLayer > 0 ) {
-                    success = (bool)fwrite( &blockMeta, 6, 1, fd );
-                    if( success) fileUpdate += 6;
-                }
-                if( success ) {
-                    success = (bool)fwrite( ptr, chunkSize, 1, fd );
-                    if( success ) fileUpdate += chunkSize;
+                unsigned long fileUpdate;
+                unsigned int nbSub = Conf.dcpBlockSize / Conf.dcpSubBlockSize;
+                uint64_t fullMask = ( nbSub == MAX_SUBBLOCKS ) ? ~0UL : (1UL << nbSub) - 1;
+                if( Data[i].filter == DCP_FILTER_NONE ) {
+                    // only write the sub-blocks that changed 
+                    uint64_t mask = ( doHash ) ? subBlockDiff( &Data[i], blockId, ptr, pos < refSize ) : fullMask;
+                    uint32_t length = __builtin_popcountl(mask)*Conf.dcpSubBlockSize;
+                    fileUpdate = writeRecord( fd, &blockMeta, mask, DCP_FILTER_NONE, ptr, length );
+                    dcpSize += (fileUpdate > 0)*length;
+                } else {
+                    unsigned char *payload;
+                    uint32_t length;
+                    unsigned char filter = filterBlock( &Data[i], blockId, ptr, pos < refSize, work, &payload, &length );
+                    fileUpdate = writeRecord( fd, &blockMeta, fullMask, filter, payload, length );
+                    dcpSize += (fileUpdate > 0)*length;
                 }
-                dcpSize += success*chunkSize;
-                Exec.dcp.dcpFileSize += success*fileUpdate;
+                success = (fileUpdate > 0);
+                Exec.dcp.dcpFileSize += fileUpdate;
                 //DBG_MSG(Exec.comm, "dcpFileSize (delta: %lu): %lu", 0, Exec.dcp.dcpFileSize-dcpOld, Exec.dcp.dcpFileSize );
             }
             
@@ -243,24 +779,31 @@ int checkpoint( int id )
         }
 
         // swap hash arrays and free old one
-        free(Data[i].hashArray);
-        Data[i].hashDataSize = dataSize;
-        Data[i].hashArray = Data[i].hashArrayTmp;
+        if( doHash ) {
+            free(Data[i].hashArray);
+            Data[i].hashDataSize = dataSize;
+            Data[i].hashArray = Data[i].hashArrayTmp;
+            Data[i].totalDirtyBlocks += Data[i].lastDirtyBlocks;
+            Data[i].touched = false;
+        } else if( Data[i].policy == DCP_POLICY_FULL ) {
+            // blocks were not hashed, the next differential checkpoint writes all blocks
+            Data[i].hashDataSize = 0;
+        }
 
     }
 
     free(block);
+    free(work);
+    
+    // pre-hashes are valid for one checkpoint
+    for(i=0; i<Exec.nbVar; i++) {
+        Data[i].validStamp = ++Data[i].stamp;
+    }
 
     fsync(fileno(fd));
     fclose( fd );
+    Exec.dcp.layerSize[dcpLayer] = Exec.dcp.dcpFileSize;
     Exec.dcp.dcpCounter++;
-    if( (dcpLayer == (Conf.dcpStackSize-1)) ) {
-        int i = 0;
-        for(; i<Exec.nbVar; i++) {
-            //free(Data[i].hashArray);
-            Data[i].hashDataSize = 0;
-        }
-    }
     if( (dcpLayer == 0) ) {
         char ofn[512];
         snprintf( ofn, BUFF, "%s/dcp-id%d-rank%d.fti", Exec.id, dcpFileId-1, Exec.commRank );
@@ -278,128 +821,750 @@ int checkpoint( int id )
     // - base size
     // - file id
     // - block size
+    // - sub-block size
     // - nb vars
     // - array of id and dataset size
+    // - nb layers
+    // - array of file size after each layer
+    // - nb processes
     mfd = fopen( mfnt, "wb" );
     fwrite( &Exec.dcp.dcpFileSize, sizeof(unsigned long), 1, mfd );
     fwrite( &glbDataSize, sizeof(unsigned long), 1, mfd );
     fwrite( &dcpFileId, sizeof(int), 1, mfd );
     fwrite( &Conf.dcpBlockSize, sizeof(unsigned long), 1, mfd );
+    fwrite( &Conf.dcpSubBlockSize, sizeof(unsigned long), 1, mfd );
     fwrite( &Exec.nbVar, sizeof(int), 1, mfd);
     for(i=0; i<Exec.nbVar; i++) {
         unsigned long dataSize = Data[i].elemSize * Data[i].nElem;
         fwrite( &Data[i].id, sizeof(int), 1, mfd );
         fwrite( &dataSize, sizeof(unsigned long), 1, mfd );
     }
+    int nbLayers = dcpLayer + 1;
+    fwrite( &nbLayers, sizeof(int), 1, mfd );
+    fwrite( Exec.dcp.layerSize, sizeof(unsigned long), nbLayers, mfd );
+    fwrite( &Exec.commSize, sizeof(int), 1, mfd );
     fclose(mfd);
 
     rename( mfnt, mfn );
 
     MPI_Barrier(Exec.comm);
+    
+    // average cost over about one stack, base layers are more expensive
+    double cost = MPI_Wtime() - t1;
+    if( Exec.dcp.dcpCounter == 1 ) {
+        Exec.dcp.dcpCost = cost;
+    } else {
+        Exec.dcp.dcpCost += (cost - Exec.dcp.dcpCost) / Conf.dcpStackSize;
+    }
+    Exec.dcp.dcpTime = MPI_Wtime();
+    
     if(Exec.commRank==0)
         printf("[INFO] Checkpoint (id:%d) succeeded (written %8lu of %8lu | file size:%8lu | time: %lf seconds.)\n", id, dcpSize, glbDataSize, Exec.dcp.dcpFileSize, t2-t1);
 
+    return SCES;
 }
 
-int recover()
+//----------------------------------------------------------------------------------------------
+// RECOVERY HELPERS
+//----------------------------------------------------------------------------------------------
+
+// reverses compression and filters of a block record and copies the block into 
+// the dataset. 'work' has to hold 2*blockSize bytes. Returns false on failure.
+static bool unfilterBlock( dataInfo *data, unsigned long blockId, unsigned long blockSize, unsigned char filter, unsigned char *payload, uint32_t length, unsigned char *work )
 {
-    int ii;
-    int dcpFileId;
-    unsigned long glbDataSize;
-    unsigned long dcpBlockSizeStored;
+    unsigned char *src = payload;
+    if( filter & RECORD_COMPRESSED ) {
+        uLongf blen = blockSize;
+        if( (uncompress( work, &blen, payload, length ) != Z_OK) || (blen != blockSize) ) {
+            return false;
+        }
+        src = work;
+    } else if( length != blockSize ) {
+        return false;
+    }
+    if( filter & DCP_FILTER_SHUFFLE ) {
+        unsigned char *dst = ( src == work ) ? work + blockSize : work;
+        unshuffle( src, dst, blockSize, data->elemSize );
+        src = dst;
+    }
+    
+    unsigned long offset = blockId * blockSize;
+    // block may stem from a layer where the dataset was larger
+    if( offset >= data->size ) return true;
+    unsigned long chunkSize = ( (data->size-offset) < blockSize ) ? data->size-offset : blockSize; 
+    if( filter & DCP_FILTER_XOR ) {
+        // the dataset holds the block of the previous layer
+        xorBlock( data->ptr + offset, src, chunkSize );
+    } else {
+        memcpy( data->ptr + offset, src, chunkSize );
+    }
+    return true;
+}
 
-    char fn[BUFF], mfn[BUFF];
-    snprintf( mfn, BUFF, "%s/dcp-rank%d.meta", Exec.id, Exec.commRank );
+// verifies the checksums of a chunk of block records and copies the intact blocks 
+// into the datasets. Returns the number of corrupted records.
+static unsigned long applyRecords( unsigned char *chunk, unsigned long nbRecords, unsigned long blockSize, unsigned long subBlockSize, int expVarId, dataInfo *vars, int nbVar )
+{
+    unsigned long nbCorrupt = 0;
+    unsigned char *work = NULL;
+    unsigned long r;
+    for(r=0; r<nbRecords; r++) {
+        unsigned char *record = chunk;
+        uint64_t mask;
+        unsigned char filter;
+        uint32_t length;
+        memcpy( &mask, record + 6, sizeof(uint64_t) );
+        memcpy( &filter, record + 6 + sizeof(uint64_t), 1 );
+        memcpy( &length, record + 6 + sizeof(uint64_t) + 1, sizeof(uint32_t) );
+        unsigned long recordSize = RECORD_HEADER_SIZE + length + CRC32_DIGEST_LENGTH;
+        chunk += recordSize;
+        
+        uint32_t crc;
+        memcpy( &crc, record + recordSize - CRC32_DIGEST_LENGTH, CRC32_DIGEST_LENGTH );
+        if( crc32cUpdate( 0, record, recordSize - CRC32_DIGEST_LENGTH ) != crc ) {
+            nbCorrupt++;
+            continue;
+        }
+        blockMetaInfo_t blockMeta = {0};
+        memcpy( &blockMeta, record, 6 );
+        int idx = getIdx( blockMeta.varId, vars, nbVar );
+        if( (idx < 0) || ((expVarId >= 0) && (blockMeta.varId != expVarId)) ) {
+            nbCorrupt++;
+            continue;
+        }
+        unsigned char *src = record + RECORD_HEADER_SIZE;
+        if( filter != DCP_FILTER_NONE ) {
+            if( work == NULL ) work = (unsigned char*) malloc( 2*blockSize );
+            if( !unfilterBlock( &vars[idx], blockMeta.blockId, blockSize, filter, src, length, work ) ) {
+                nbCorrupt++;
+            }
+            continue;
+        }
+        unsigned int s;
+        for(s=0; s<blockSize/subBlockSize; s++) {
+            if( !(mask & (1UL << s)) ) continue;
+            unsigned long offset = blockMeta.blockId * blockSize + s * subBlockSize;
+            // block may stem from a layer where the dataset was larger
+            if( offset < vars[idx].size ) {
+                unsigned long chunkSize = ( (vars[idx].size-offset) < subBlockSize ) ? vars[idx].size-offset : subBlockSize; 
+                memcpy( vars[idx].ptr + offset, src, chunkSize );
+            }
+            src += subBlockSize;
+        }
+    }
+    free(work);
+    return nbCorrupt;
+}
+
+// reads block records from 'fd' until either 'nbRecords' records or 'nbBytes' bytes are 
+// consumed. The master thread keeps on reading while the other threads verify and apply 
+// the chunks already read. Returns the number of corrupted records or -1 if the file is 
+// truncated.
+static long readRecords( FILE *fd, unsigned long nbRecords, unsigned long nbBytes, unsigned long blockSize, unsigned long subBlockSize, int expVarId, dataInfo *vars, int nbVar )
+{
+    unsigned int nbSub = blockSize / subBlockSize;
+    unsigned long maxRecordSize = RECORD_HEADER_SIZE + blockSize + CRC32_DIGEST_LENGTH;
+    unsigned long chunkSize = RECOVER_CHUNK_BLOCKS * maxRecordSize;
+    int nbChunks = 2*omp_get_max_threads();
+    unsigned char *buffer = (unsigned char*) malloc( nbChunks * chunkSize );
+    unsigned long nbCorrupt = 0;
+    bool truncated = false;
+
+    #pragma omp parallel
+    #pragma omp single
+    {
+        unsigned long done = 0, bytes = 0;
+        int slot = 0;
+        while( (done < nbRecords) && (bytes < nbBytes) && !truncated ) {
+            // all chunk buffers in use
+            if( slot == nbChunks ) {
+                #pragma omp taskwait
+                slot = 0;
+            }
+            unsigned char *chunk = buffer + slot*chunkSize;
+            unsigned long n = 0;
+            unsigned char *pos = chunk;
+            while( (n < RECOVER_CHUNK_BLOCKS) && (done+n < nbRecords) && (bytes < nbBytes) ) {
+                // header of variable sized record
+                if( !fread( pos, RECORD_HEADER_SIZE, 1, fd ) ) {
+                    truncated = true;
+                    break;
+                }
+                uint64_t mask;
+                unsigned char filter;
+                uint32_t length;
+                memcpy( &mask, pos + 6, sizeof(uint64_t) );
+                memcpy( &filter, pos + 6 + sizeof(uint64_t), 1 );
+                memcpy( &length, pos + 6 + sizeof(uint64_t) + 1, sizeof(uint32_t) );
+                if( ((nbSub < MAX_SUBBLOCKS) && (mask >> nbSub)) || (length > blockSize)
+                        || ((filter == DCP_FILTER_NONE) && (length != __builtin_popcountl(mask) * subBlockSize)) ) {
+                    truncated = true;
+                    break;
+                }
+                unsigned long rest = length + CRC32_DIGEST_LENGTH;
+                if( !fread( pos + RECORD_HEADER_SIZE, rest, 1, fd ) ) {
+                    truncated = true;
+                    break;
+                }
+                pos += RECORD_HEADER_SIZE + rest;
+                bytes += RECORD_HEADER_SIZE + rest;
+                n++;
+            }
+            #pragma omp task firstprivate(chunk, n)
+            {
+                unsigned long nc = applyRecords( chunk, n, blockSize, subBlockSize, expVarId, vars, nbVar );
+                #pragma omp atomic
+                nbCorrupt += nc;
+            }
+            done += n;
+            slot++;
+        }
+        #pragma omp taskwait
+        truncated |= (nbBytes != ULONG_MAX) && (bytes != nbBytes);
+    }
+
+    free(buffer);
+    return ( truncated ) ? -1 : (long) nbCorrupt;
+}
+
+// reads the meta file of 'rank' in checkpoint directory 'execId'. On success, 
+// 'meta->layerSize' has to be freed by the caller.
+static int readMeta( const char *execId, int rank, metaInfo *meta )
+{
+    char mfn[BUFF];
+    snprintf( mfn, BUFF, "%s/dcp-rank%d.meta", execId, rank );
     
+    meta->layerSize = NULL;
     FILE* mfd = fopen( mfn, "rb" );
-    fread( &Exec.dcp.dcpFileSize, sizeof(unsigned long), 1, mfd );
-    fread( &glbDataSize, sizeof(unsigned long), 1, mfd );
-    fread( &dcpFileId, sizeof(int), 1, mfd );
-    fread( &dcpBlockSizeStored, sizeof(unsigned long), 1, mfd );
-    fread( &Exec.nbVar, sizeof(int), 1, mfd);
+    if( mfd == NULL ) {
+        ERR_MSG( Exec.comm, "unable to open meta file '%s'", Exec.commRank, mfn );
+        return NSCS;
+    }
+    
+    bool success = true;
+    success &= fread( &meta->fileSize, sizeof(unsigned long), 1, mfd );
+    success &= fread( &meta->glbDataSize, sizeof(unsigned long), 1, mfd );
+    success &= fread( &meta->fileId, sizeof(int), 1, mfd );
+    success &= fread( &meta->blockSize, sizeof(unsigned long), 1, mfd );
+    success &= fread( &meta->subBlockSize, sizeof(unsigned long), 1, mfd );
+    success &= (meta->subBlockSize > 0) && (meta->blockSize % meta->subBlockSize == 0) 
+        && (meta->blockSize / meta->subBlockSize <= MAX_SUBBLOCKS);
+    success &= fread( &meta->nbVar, sizeof(int), 1, mfd);
+    success &= (meta->nbVar >= 0) && (meta->nbVar <= BUFF);
     int i;
-    for(i=0; i<Exec.nbVar; i++) {
-        unsigned int varId;
-        fread( &varId, sizeof(int), 1, mfd );
-        int idx = getIdx( varId, Data );
-        if( idx < 0 ) {
-            ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, varId );
-            return NSCS;
-        }
-        //DBG_MSG(MPI_COMM_WORLD, "varId: %d, Data[%d].id:%d"  ,0, varId, idx, Data[idx].id );
-        fread( &Data[idx].size, sizeof(unsigned long), 1, mfd );
-        //DBG_MSG(MPI_COMM_WORLD, "Data[%d].size:%lu"  ,0, idx, Data[i].size );
+    for(i=0; success && i<meta->nbVar; i++) {
+        success &= fread( &meta->varId[i], sizeof(int), 1, mfd );
+        success &= fread( &meta->varSize[i], sizeof(unsigned long), 1, mfd );
     }
+    success &= fread( &meta->nbLayers, sizeof(int), 1, mfd );
+    success &= (meta->nbLayers > 0) && (meta->nbLayers <= Conf.dcpStackSize);
+    if( success ) {
+        meta->layerSize = (unsigned long*) malloc( sizeof(unsigned long)*meta->nbLayers );
+        success &= (fread( meta->layerSize, sizeof(unsigned long), meta->nbLayers, mfd ) == meta->nbLayers);
+    }
+    success &= fread( &meta->commSize, sizeof(int), 1, mfd );
     fclose(mfd);
     
-    //DBG_MSG(MPI_COMM_WORLD, "Exec.dcp.dcpFileSize:%lu"  ,0, Exec.dcp.dcpFileSize );
-    //DBG_MSG(MPI_COMM_WORLD, "glbDataSize:%lu"           ,0, glbDataSize );
-    //DBG_MSG(MPI_COMM_WORLD, "dcpFileId:%d"             ,0, dcpFileId );
-    //DBG_MSG(MPI_COMM_WORLD, "dcpBlockSizeStored:%lu"    ,0, dcpBlockSizeStored );
-    //DBG_MSG(MPI_COMM_WORLD, "Exec.nbVar:%d"            ,0, Exec.nbVar );
+    if( !success ) {
+        ERR_MSG( Exec.comm, "meta file '%s' is corrupted", Exec.commRank, mfn );
+        free(meta->layerSize);
+        meta->layerSize = NULL;
+        return NSCS;
+    }
 
-    snprintf( fn, BUFF, "%s/dcp-id%d-rank%d.fti", Exec.id, dcpFileId, Exec.commRank );
+    return SCES;
+}
+
+// recovers the datasets 'vars' of 'rank' in checkpoint directory 'execId' from base and 
+// layers up to 'maxLayers'. The sizes of 'vars' have to match the meta data, the datasets 
+// may have been resized since the base was written. 'validLayers' 
+// receives the number of layers that passed the integrity check. Returns the number of 
+// layers that were (partially) copied into the datasets.
+static int recoverLayers( const char *execId, int rank, metaInfo *meta, dataInfo *vars, int nbVar, int maxLayers, int *validLayers )
+{
+    *validLayers = 0;
+    
+    if( maxLayers > meta->nbLayers ) maxLayers = meta->nbLayers;
+    
+    char fn[BUFF];
+    snprintf( fn, BUFF, "%s/dcp-id%d-rank%d.fti", execId, meta->fileId, rank );
    
-    // read base part of file
     FILE* fd = fopen( fn, "rb" );
-    for(i=0; i<Exec.nbVar; i++) {
+    if( fd == NULL ) {
+        ERR_MSG( Exec.comm, "unable to open checkpoint file '%s'", Exec.commRank, fn );
+        return 0;
+    }
+
+    // read base layer
+    long nbCorrupt = 0;
+    int i;
+    for(i=0; (nbCorrupt == 0) && i<meta->nbVar; i++) {
         unsigned int varId;
         unsigned long locDataSize;
-        fread( &varId, sizeof(int), 1, fd );
-        fread( &locDataSize, sizeof(unsigned long), 1, fd );
-        int idx = getIdx(varId, Data);
-        if( idx < 0 ) {
-            ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, varId );
-            return NSCS;
+        if( !fread( &varId, sizeof(int), 1, fd ) || !fread( &locDataSize, sizeof(unsigned long), 1, fd ) ) {
+            nbCorrupt = -1;
+            break;
         }
-        fread( Data[idx].ptr, locDataSize, 1, fd );
-        int overflow;
-        if( (overflow=locDataSize%dcpBlockSizeStored) != 0 ) {
-            void *buffer = (void*) malloc( dcpBlockSizeStored - overflow ); 
-            fread( buffer, dcpBlockSizeStored - overflow, 1, fd );
-            free(buffer);
+        int idx = getIdx( varId, vars, nbVar );
+        if( idx < 0 ) {
+            nbCorrupt = 1;
+            break;
         }
+        // blocks beyond the current size are skipped in applyRecords
+        unsigned long nbBlocks = locDataSize/meta->blockSize + (bool)(locDataSize%meta->blockSize);
+        nbCorrupt = readRecords( fd, nbBlocks, ULONG_MAX, meta->blockSize, meta->subBlockSize, varId, vars, nbVar );
+    }
+    if( (nbCorrupt == 0) && (ftell( fd ) != meta->layerSize[0]) ) {
+        nbCorrupt = 1;
+    }
+    if( nbCorrupt != 0 ) {
+        ERR_MSG( Exec.comm, "integrity check failed for base layer of '%s'", Exec.commRank, fn );
+        fclose(fd);
+        return 1;
     }
+    *validLayers = 1;
     
-    unsigned long pos = ftell( fd );
+    // read additional layers
+    int layer;
+    for(layer=1; layer<maxLayers; layer++) {
+        if( meta->layerSize[layer] < meta->layerSize[layer-1] ) {
+            nbCorrupt = 1;
+        } else {
+            unsigned long layerBytes = meta->layerSize[layer] - meta->layerSize[layer-1];
+            nbCorrupt = readRecords( fd, ULONG_MAX, layerBytes, meta->blockSize, meta->subBlockSize, -1, vars, nbVar );
+        }
+        if( nbCorrupt != 0 ) {
+            ERR_MSG( Exec.comm, "integrity check failed for layer %d of '%s' (corrupted blocks: %ld)", Exec.commRank, layer, fn, nbCorrupt );
+            fclose(fd);
+            return layer+1;
+        }
+        *validLayers = layer+1;
+    }
+
+    fclose(fd);
+    return maxLayers;
+}
+
+// all ranks have to recover the same layer. Returns the number of layers intact on all ranks.
+static int agreeOnLayers( int validLayers, bool failed )
+{
+    int glbValidLayers, nbFailed;
+    int failed_ = failed;
+    MPI_Allreduce( &validLayers, &glbValidLayers, 1, MPI_INT, MPI_MIN, Exec.comm );
+    MPI_Allreduce( &failed_, &nbFailed, 1, MPI_INT, MPI_SUM, Exec.comm );
     
-    unsigned long offset;
+    if( glbValidLayers == 0 ) {
+        ERR_MSG( Exec.comm, "recovery failed, no intact base layer on %d rank(s)!", 0, nbFailed );
+    } else if( (nbFailed > 0) && (Exec.commRank == 0) ) {
+        printf("[WARNING] integrity check failed on %d rank(s), falling back to layer %d.\n", nbFailed, glbValidLayers-1);
+    }
 
-    blockMetaInfo_t blockMeta;
-    unsigned char *block = (unsigned char*) malloc( dcpBlockSizeStored );
+    return glbValidLayers;
+}
 
-    //DBG_MSG(Exec.comm,"pos:%lu",0,pos);
-    unsigned long check = pos;
-    unsigned long check_exp = pos;
-    while( pos < Exec.dcp.dcpFileSize ) {
-        
-        //DBG_MSG(Exec.comm,"pos:%lu, check:%lu, exp: %lu",0,pos, check, check_exp);
-        check += dcpBlockSizeStored+6;
-        check_exp += fread( &blockMeta, 6, 1, fd )*6;
+// the recovered data does not match the hashes, start a new base with the next checkpoint.
+static void resetHashes()
+{
+    if( Exec.dcp.dcpCounter % Conf.dcpStackSize ) {
+        Exec.dcp.dcpCounter = (Exec.dcp.dcpCounter / Conf.dcpStackSize + 1) * Conf.dcpStackSize;
+    }
+    int i;
+    for(i=0; i<Exec.nbVar; i++) {
+        Data[i].hashDataSize = 0;
+    }
+}
 
+// assigns the files of the old ranks to the current ranks, largest first to the rank 
+// with the least load, so that all ranks read about the same amount of data.
+static int cmpFileLoad( const void *a, const void *b )
+{
+    const fileLoad *fa = a, *fb = b;
+    if( fa->size != fb->size ) return ( fa->size < fb->size ) ? 1 : -1;
+    return fa->rank - fb->rank;
+}
 
-        int idx = getIdx(blockMeta.varId, Data);
-        if( idx < 0 ) {
-            ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, blockMeta.varId );
-            return NSCS;
+static void assignFiles( unsigned long *sizes, int oldSize, int nbVar, int *owner )
+{
+    fileLoad *files = (fileLoad*) malloc( sizeof(fileLoad)*oldSize );
+    unsigned long *load = (unsigned long*) calloc( Exec.commSize, sizeof(unsigned long) );
+    int r, k;
+    for(r=0; r<oldSize; r++) {
+        files[r].rank = r;
+        files[r].size = 0;
+        for(k=0; k<nbVar; k++) {
+            files[r].size += sizes[r*nbVar + k];
+        }
+    }
+    qsort( files, oldSize, sizeof(fileLoad), cmpFileLoad );
+    for(r=0; r<oldSize; r++) {
+        int min = 0;
+        for(k=1; k<Exec.commSize; k++) {
+            if( load[k] < load[min] ) min = k;
+        }
+        owner[files[r].rank] = min;
+        load[min] += files[r].size;
+    }
+    free(files);
+    free(load);
+}
+
+// sends the elements of dataset 'k' held in the datasets 'tmp' of the old ranks 'owned' 
+// to their new owners and copies the received elements into the dataset.
+static int redistribute( int k, dataInfo *tmp, int *owned, int nbOwned, unsigned long *sizes, int oldSize, dcpPartitionFunc partition )
+{
+    int id = Data[k].id;
+    size_t elemSize = Data[k].elemSize;
+    int nbVar = Exec.nbVar;
+    int error = 0;
+    int j, r;
+    
+    // global element offset of each old rank
+    size_t *glbOffset = (size_t*) malloc( sizeof(size_t)*oldSize );
+    size_t offset = 0;
+    for(r=0; r<oldSize; r++) {
+        glbOffset[r] = offset;
+        offset += sizes[r*nbVar + k] / elemSize;
+    }
+    
+    // collect segments
+    size_t maxSegments = 64, nbSegments = 0;
+    segmentInfo *segments = (segmentInfo*) malloc( sizeof(segmentInfo)*maxSegments );
+    int *segmentRank = (int*) malloc( sizeof(int)*maxSegments );
+    unsigned char **segmentSrc = (unsigned char**) malloc( sizeof(unsigned char*)*maxSegments );
+    unsigned long *sendBytes = (unsigned long*) calloc( Exec.commSize, sizeof(unsigned long) );
+    for(j=0; !error && j<nbOwned; j++) {
+        dataInfo *var = &tmp[j*nbVar + k];
+        size_t nElem = var->size / elemSize;
+        size_t e = 0;
+        while( e < nElem ) {
+            int dst = -1;
+            size_t localIdx = 0, count = 0;
+            partition( id, glbOffset[owned[j]] + e, &dst, &localIdx, &count );
+            if( (dst < 0) || (dst >= Exec.commSize) || (count == 0) ) {
+                ERR_MSG( Exec.comm, "invalid partition of element %lu of id '%d' (rank: %d, count: %lu)", Exec.commRank, glbOffset[owned[j]] + e, id, dst, count );
+                error = 1;
+                break;
+            }
+            if( count > nElem - e ) count = nElem - e;
+            if( nbSegments == maxSegments ) {
+                maxSegments *= 2;
+                segments = (segmentInfo*) realloc( segments, sizeof(segmentInfo)*maxSegments );
+                segmentRank = (int*) realloc( segmentRank, sizeof(int)*maxSegments );
+                segmentSrc = (unsigned char**) realloc( segmentSrc, sizeof(unsigned char*)*maxSegments );
+            }
+            segments[nbSegments].localIdx = localIdx;
+            segments[nbSegments].count = count;
+            segmentRank[nbSegments] = dst;
+            segmentSrc[nbSegments] = var->ptr + e*elemSize;
+            nbSegments++;
+            sendBytes[dst] += sizeof(segmentInfo) + count*elemSize;
+            e += count;
+        }
+    }
+    
+    MPI_Allreduce( MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, Exec.comm );
+    
+    // byte counts may exceed int, exchange in messages of at most EXCHANGE_CHUNK_SIZE bytes
+    unsigned long *recvBytes = (unsigned long*) malloc( sizeof(unsigned long)*Exec.commSize );
+    
+    unsigned char *sendBuf = NULL, *recvBuf = NULL;
+    if( !error ) {
+        MPI_Alltoall( sendBytes, 1, MPI_UNSIGNED_LONG, recvBytes, 1, MPI_UNSIGNED_LONG, Exec.comm );
+        size_t sendTotal = 0, recvTotal = 0;
+        size_t nbRequests = 0;
+        for(r=0; r<Exec.commSize; r++) {
+            sendTotal += sendBytes[r];
+            recvTotal += recvBytes[r];
+            nbRequests += (sendBytes[r] + EXCHANGE_CHUNK_SIZE - 1) / EXCHANGE_CHUNK_SIZE;
+            nbRequests += (recvBytes[r] + EXCHANGE_CHUNK_SIZE - 1) / EXCHANGE_CHUNK_SIZE;
+        }
+        
+        // pack segments ordered by destination
+        sendBuf = (unsigned char*) malloc( sendTotal + 1 );
+        recvBuf = (unsigned char*) malloc( recvTotal + 1 );
+        size_t *pos = (size_t*) malloc( sizeof(size_t)*Exec.commSize );
+        pos[0] = 0;
+        for(r=1; r<Exec.commSize; r++) {
+            pos[r] = pos[r-1] + sendBytes[r-1];
         }
+        size_t i;
+        for(i=0; i<nbSegments; i++) {
+            int dst = segmentRank[i];
+            memcpy( sendBuf + pos[dst], &segments[i], sizeof(segmentInfo) );
+            memcpy( sendBuf + pos[dst] + sizeof(segmentInfo), segmentSrc[i], segments[i].count*elemSize );
+            pos[dst] += sizeof(segmentInfo) + segments[i].count*elemSize;
+        }
+        free(pos);
         
+        // messages between two ranks are received in the order they were sent
+        MPI_Request *requests = (MPI_Request*) malloc( sizeof(MPI_Request)*(nbRequests+1) );
+        size_t n = 0;
+        unsigned char *recvPtr = recvBuf;
+        unsigned char *sendPtr = sendBuf;
+        for(r=0; r<Exec.commSize; r++) {
+            size_t done;
+            for(done=0; done<recvBytes[r]; done+=EXCHANGE_CHUNK_SIZE) {
+                int count = ( (recvBytes[r]-done) < EXCHANGE_CHUNK_SIZE ) ? recvBytes[r]-done : EXCHANGE_CHUNK_SIZE;
+                MPI_Irecv( recvPtr + done, count, MPI_BYTE, r, EXCHANGE_TAG, Exec.comm, &requests[n++] );
+            }
+            recvPtr += recvBytes[r];
+        }
+        for(r=0; r<Exec.commSize; r++) {
+            size_t done;
+            for(done=0; done<sendBytes[r]; done+=EXCHANGE_CHUNK_SIZE) {
+                int count = ( (sendBytes[r]-done) < EXCHANGE_CHUNK_SIZE ) ? sendBytes[r]-done : EXCHANGE_CHUNK_SIZE;
+                MPI_Isend( sendPtr + done, count, MPI_BYTE, r, EXCHANGE_TAG, Exec.comm, &requests[n++] );
+            }
+            sendPtr += sendBytes[r];
+        }
+        MPI_Waitall( n, requests, MPI_STATUSES_IGNORE );
+        free(requests);
+
+        // check all segments first, the dataset is left untouched on failure
+        size_t nElem = Data[k].size / elemSize;
+        size_t p = 0;
+        while( !error && (p < recvTotal) ) {
+            segmentInfo segment;
+            memcpy( &segment, recvBuf + p, sizeof(segmentInfo) );
+            if( (segment.localIdx > nElem) || (segment.count > nElem - segment.localIdx) ) {
+                ERR_MSG( Exec.comm, "elements [%lu,%lu) of id '%d' exceed the protected size (%lu elements)", Exec.commRank, segment.localIdx, segment.localIdx + segment.count, id, nElem );
+                error = 1;
+            }
+            p += sizeof(segmentInfo) + segment.count*elemSize;
+        }
+        MPI_Allreduce( MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, Exec.comm );
         
-        offset = blockMeta.blockId * dcpBlockSizeStored;
-        void* ptr = Data[idx].ptr + offset;
-        unsigned int chunkSize = ( (Data[idx].size-offset) < dcpBlockSizeStored ) ? Data[idx].size-offset : dcpBlockSizeStored; 
+        // unpack segments
+        p = 0;
+        while( !error && (p < recvTotal) ) {
+            segmentInfo segment;
+            memcpy( &segment, recvBuf + p, sizeof(segmentInfo) );
+            p += sizeof(segmentInfo);
+            memcpy( Data[k].ptr + segment.localIdx*elemSize, recvBuf + p, segment.count*elemSize );
+            p += segment.count*elemSize;
+        }
+    }
+    
+    free(glbOffset);
+    free(segments);
+    free(segmentRank);
+    free(segmentSrc);
+    free(sendBytes);
+    free(recvBytes);
+    free(sendBuf);
+    free(recvBuf);
+
+    return ( error ) ? NSCS : SCES;
+}
+
+// Daly's higher order approximation of the optimum checkpoint interval. Without configured
+// MTBF, the mean interval between recoveries is used once an interval was observed. A 
+// single recovery (e.g. after restart) is no MTBF sample.
+static double optimalInterval()
+{
+    double mtbf = Conf.mtbf;
+    if( mtbf <= 0 ) {
+        mtbf = ( Exec.nbRecoveries > 1 ) ? (Exec.lastRecovery - Exec.firstRecovery) / (Exec.nbRecoveries-1) : DEFAULT_MTBF;
+        if( mtbf <= 0 ) mtbf = DEFAULT_MTBF;
+    }
+    double cost = Exec.dcp.dcpCost;
+    if( cost >= 2*mtbf ) {
+        return mtbf;
+    }
+    double ratio = cost / (2*mtbf);
+    return sqrt( 2*cost*mtbf ) * ( 1 + sqrt( ratio )/3 + ratio/9 ) - cost;
+}
 
-        //DBG_MSG(Exec.comm, "Data[0].id:%d, offset:%lu, chunksize: %lu", 0, Data[0].id, offset, chunkSize);
-        check_exp += chunkSize*fread( ptr, chunkSize, 1, fd );
-        if( chunkSize < dcpBlockSizeStored ) {
-            check_exp += (dcpBlockSizeStored-chunkSize)*fread( block, dcpBlockSizeStored-chunkSize, 1, fd );
+int checkpointIfDue( int id )
+{
+    int status = SCES;
+    
+    // the decision was reduced in the background since the previous call
+    if( Exec.dcp.dueRequest != MPI_REQUEST_NULL ) {
+        MPI_Wait( &Exec.dcp.dueRequest, MPI_STATUS_IGNORE );
+        // stale if the stack changed in between
+        if( Exec.dcp.dueGlb && (Exec.dcp.dueCounter == Exec.dcp.dcpCounter) ) {
+            status = checkpoint( id );
         }
-        unsigned long posOld = pos;
-        pos += (dcpBlockSizeStored+6);
-        //DBG_MSG(Exec.comm, "pos (delta: %lu): %lu", 0, pos-posOld, pos );
-        //DBG_MSG( MPI_COMM_WORLD, "varId:%d blockId: %d, chunkSize:%lu, fileSize: %lu, pos: %lu",0, blockMeta.varId, blockMeta.blockId, chunkSize, Exec.dcp.dcpFileSize, pos );
     }
 
-    fclose(fd);
+    Exec.dcp.dueLoc = ( (MPI_Wtime() - Exec.dcp.dcpTime) >= optimalInterval() );
+    Exec.dcp.dueCounter = Exec.dcp.dcpCounter;
+    MPI_Iallreduce( &Exec.dcp.dueLoc, &Exec.dcp.dueGlb, 1, MPI_INT, MPI_MAX, Exec.comm, &Exec.dcp.dueRequest );
+    
+    return status;
+}
+
+int recover()
+{
+    metaInfo meta;
+    int validLayers = 0;
+    int appliedLayers = 0;
+    bool failed = true;
+    
+    invalidatePreHashes();
+    
+    if( readMeta( Exec.id, Exec.commRank, &meta ) == SCES ) {
+        failed = false;
+        int i;
+        for(i=0; i<meta.nbVar; i++) {
+            int idx = getIdx( meta.varId[i], Data, Exec.nbVar );
+            if( idx < 0 ) {
+                ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, meta.varId[i] );
+                failed = true;
+                break;
+            }
+            Data[idx].size = meta.varSize[i];
+        }
+        if( !failed ) {
+            Exec.dcp.dcpFileSize = meta.fileSize;
+            memcpy( Exec.dcp.layerSize, meta.layerSize, sizeof(unsigned long)*meta.nbLayers );
+            appliedLayers = recoverLayers( Exec.id, Exec.commRank, &meta, Data, Exec.nbVar, INT_MAX, &validLayers );
+            failed = (validLayers < meta.nbLayers);
+        }
+    }
+    Exec.lastRecovery = MPI_Wtime();
+    if( Exec.nbRecoveries++ == 0 ) Exec.firstRecovery = Exec.lastRecovery;
+    
+    int glbValidLayers = agreeOnLayers( validLayers, failed );
+    if( glbValidLayers == 0 ) {
+        free(meta.layerSize);
+        return NSCS;
+    }
+   
+    if( glbValidLayers < meta.nbLayers ) {
+        if( appliedLayers > glbValidLayers ) {
+            recoverLayers( Exec.id, Exec.commRank, &meta, Data, Exec.nbVar, glbValidLayers, &validLayers );
+        }
+        // the discarded layers remain in the file
+        resetHashes();
+    }
+    free(meta.layerSize);
+
+    return SCES;
 }
 
+int recoverFrom( const char *execId, dcpPartitionFunc partition )
+{
+    if( (execId == NULL) || (partition == NULL) ) {
+        ERR_MSG( Exec.comm, "invalid execution id or partition function (NULL).", Exec.commRank );
+        return NSCS;
+    }
+
+    int nbVar = Exec.nbVar;
+    metaInfo meta;
+    int r, j, k;
+    
+    invalidatePreHashes();
+    
+    // number of ranks of the checkpointed execution
+    int oldSize = 0;
+    if( Exec.commRank == 0 ) {
+        if( readMeta( execId, 0, &meta ) == SCES ) {
+            oldSize = meta.commSize;
+            free(meta.layerSize);
+        }
+    }
+    MPI_Bcast( &oldSize, 1, MPI_INT, 0, Exec.comm );
+    if( oldSize <= 0 ) {
+        ERR_MSG( Exec.comm, "unable to restart from '%s'", 0, execId );
+        return NSCS;
+    }
+
+    // dataset sizes of the old ranks, each rank reads a share of the meta files
+    unsigned long *sizes = (unsigned long*) calloc( (size_t)oldSize*nbVar, sizeof(unsigned long) );
+    int error = 0;
+    for(r=Exec.commRank; r<oldSize; r+=Exec.commSize) {
+        if( readMeta( execId, r, &meta ) != SCES ) {
+            error = 1;
+            continue;
+        }
+        error |= (meta.commSize != oldSize);
+        for(j=0; j<meta.nbVar; j++) {
+            k = getIdx( meta.varId[j], Data, nbVar );
+            if( k < 0 ) {
+                ERR_MSG( Exec.comm, "id '%d' does not exist!", Exec.commRank, meta.varId[j] );
+                error = 1;
+                continue;
+            }
+            sizes[r*nbVar + k] = meta.varSize[j];
+        }
+        free(meta.layerSize);
+    }
+    MPI_Allreduce( MPI_IN_PLACE, sizes, oldSize*nbVar, MPI_UNSIGNED_LONG, MPI_SUM, Exec.comm );
+    MPI_Allreduce( MPI_IN_PLACE, &error, 1, MPI_INT, MPI_MAX, Exec.comm );
+    if( error ) {
+        ERR_MSG( Exec.comm, "inconsistent meta data in '%s'", 0, execId );
+        free(sizes);
+        return NSCS;
+    }
+
+    int *owner = (int*) malloc( sizeof(int)*oldSize );
+    assignFiles( sizes, oldSize, nbVar, owner );
+    int nbOwned = 0;
+    for(r=0; r<oldSize; r++) {
+        nbOwned += (owner[r] == Exec.commRank);
+    }
+    int *owned = (int*) malloc( sizeof(int)*(nbOwned+1) );
+    for(r=0, j=0; r<oldSize; r++) {
+        if( owner[r] == Exec.commRank ) owned[j++] = r;
+    }
+
+    // read the datasets of the assigned old ranks
+    dataInfo *tmp = (dataInfo*) calloc( (size_t)nbOwned*nbVar + 1, sizeof(dataInfo) );
+    int *applied = (int*) calloc( nbOwned + 1, sizeof(int) );
+    int validLayers = INT_MAX;
+    bool failed = false;
+    for(j=0; j<nbOwned; j++) {
+        for(k=0; k<nbVar; k++) {
+            dataInfo *var = &tmp[j*nbVar + k];
+            var->id = Data[k].id;
+            var->elemSize = Data[k].elemSize;
+            var->size = sizes[owned[j]*nbVar + k];
+            var->ptr = malloc( var->size + 1 );
+        }
+        int valid = 0;
+        if( readMeta( execId, owned[j], &meta ) == SCES ) {
+            applied[j] = recoverLayers( execId, owned[j], &meta, &tmp[j*nbVar], nbVar, INT_MAX, &valid );
+            failed |= (valid < meta.nbLayers);
+            free(meta.layerSize);
+        } else {
+            failed = true;
+        }
+        if( valid < validLayers ) validLayers = valid;
+    }
+
+    int glbValidLayers = agreeOnLayers( validLayers, failed );
+    int status = ( glbValidLayers > 0 ) ? SCES : NSCS;
+    
+    for(j=0; (status == SCES) && j<nbOwned; j++) {
+        if( applied[j] > glbValidLayers ) {
+            int valid;
+            readMeta( execId, owned[j], &meta );
+            recoverLayers( execId, owned[j], &meta, &tmp[j*nbVar], nbVar, glbValidLayers, &valid );
+            free(meta.layerSize);
+        }
+    }
+
+    // send the elements to their new owners
+    for(k=0; (status == SCES) && k<nbVar; k++) {
+        status = redistribute( k, tmp, owned, nbOwned, sizes, oldSize, partition );
+    }
+    
+    for(j=0; j<nbOwned*nbVar; j++) {
+        free(tmp[j].ptr);
+    }
+    free(tmp);
+    free(applied);
+    free(owned);
+    free(owner);
+    free(sizes);
+    
+    resetHashes();
+    
+    if( (status == SCES) && (Exec.commRank == 0) ) {
+        printf("[INFO] Restart from '%s' (%d ranks) on %d ranks succeeded.\n", execId, oldSize, Exec.commSize);
+    }
+
+    return status;
+}
@@ -3,9 +3,54 @@
 #define SCES 0
 #define NSCS -1
 
+// FILTERS (compressed before written)
+
+#define DCP_FILTER_NONE     0x0
+#define DCP_FILTER_SHUFFLE  0x1 // byte-shuffle by element size
+#define DCP_FILTER_XOR      0x2 // XOR against the previous checkpoint of the block
+
+// POLICIES
+
+#define DCP_POLICY_DIFFERENTIAL 0 // hash and write dirty blocks (default)
+#define DCP_POLICY_STATIC       1 // hash once, afterwards only after touch()
+#define DCP_POLICY_FULL         2 // write all blocks without hashing
+#define DCP_POLICY_NTH          3 // differential every nth checkpoint
+
+// TYPES
+
+typedef struct dcpVarStats
+{
+    unsigned long nbBlocks;
+    unsigned long nbHashed; // checkpoints in which the dataset was hashed
+    unsigned long lastDirtyBlocks; // dirty blocks at the last hashed checkpoint
+    unsigned long totalDirtyBlocks;
+} dcpVarStats;
+
+// maps element 'globalIdx' of dataset 'id' (datasets of all ranks of the checkpointed run
+// concatenated in rank order) to its new owner 'rank' and its index 'localIdx' there. 
+// 'count' receives the number of consecutive elements that follow the same mapping.
+typedef void (*dcpPartitionFunc)( int id, size_t globalIdx, int *rank, size_t *localIdx, size_t *count );
+
 // API FUNCTIONS
 
 int init( MPI_Comm comm );
+// has to be called before MPI_Finalize. Completes the pending decision of checkpointIfDue()
+// and terminates the background hasher.
+int finalize();
 int protect( int id, void* ptr, size_t nElem, size_t elemSize );
 int checkpoint( int id );
+// checkpoints if the optimum interval elapsed since the last checkpoint. The decision is 
+// reduced in the background and applied with the next call. It is discarded if checkpoint() 
+// was called in between.
+int checkpointIfDue( int id );
 int recover();
+// restarts from checkpoint directory 'execId' written with a different number of ranks. 
+// On failure, datasets redistributed before the failing one hold the recovered data.
+int recoverFrom( const char *execId, dcpPartitionFunc partition );
+int setFilter( int id, int filter );
+int setPolicy( int id, int policy, int nth );
+int touch( int id );
+int regionDone( int id, size_t offset, size_t len );
+int regionModified( int id, size_t offset, size_t len );
+int getVarStats( int id, dcpVarStats *stats );
+long getHeatMap( int id, unsigned int *heatMap, size_t nbBlocks );
@@ -10,6 +10,17 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <math.h>
+#include <unistd.h>
+#include <limits.h>
+#include <omp.h>
+#include <pthread.h>
+#if defined(__x86_64__)
+#   include <nmmintrin.h>
+#   include <tmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#   include <arm_acle.h>
+#endif
 
 #ifndef MD5_DIGEST_LENGTH
 #   define MD5_DIGEST_LENGTH 16 // 128 bits
@@ -58,6 +69,14 @@
 #define MAX_VAR_ID 0x3ffff
 #define BLOCK_META_LENGTH 48
 #define BLOCK_IDX_OFFSET 18 
+#define RECOVER_CHUNK_BLOCKS 64
+#define EXCHANGE_CHUNK_SIZE (1UL<<30) // bytes per message in N-to-M restart
+#define EXCHANGE_TAG 0
+#define MAX_SUBBLOCKS 64 // sub-block mask is 64 bits
+#define RECORD_HEADER_SIZE 19 // meta (6), sub-block mask (8), filter (1), payload length (4)
+#define RECORD_COMPRESSED 0x4 // record filter flag, payload is deflated
+#define DEFAULT_MTBF 86400.0 // seconds
+#define PREHASH_JOB_BLOCKS 64
 
 // TYPES
 
@@ -81,12 +100,22 @@ typedef struct confInfo
     unsigned char* (*hashFunc)( const unsigned char *data, unsigned long nBytes, unsigned char *hash );
     unsigned int dcpStackSize;
     unsigned long dcpBlockSize;
+    unsigned long dcpSubBlockSize;
+    double mtbf; // seconds, measured from recoveries if <= 0
+    bool preHashThread;
 } confInfo;
 
 typedef struct dcpInfo
 {
     int dcpCounter;
     unsigned long dcpFileSize;
+    unsigned long *layerSize; // file size after each layer of the current stack
+    double dcpCost; // moving average of the checkpoint time
+    double dcpTime; // end of last checkpoint
+    int dueLoc;
+    int dueGlb;
+    int dueCounter; // dcpCounter when the decision was made
+    MPI_Request dueRequest;
 } dcpInfo;
 
 typedef struct execInfo
@@ -99,6 +128,9 @@ typedef struct execInfo
     int commRank;
     int nodeSize;
     int nodeId;
+    double firstRecovery; // time of the first recover() call
+    double lastRecovery;
+    int nbRecoveries;
     struct dcpInfo dcp;
 } execInfo;
 
@@ -112,8 +144,74 @@ typedef struct dataInfo
     void *ptr;
     unsigned char *hashArray;
     unsigned char *hashArrayTmp;
+    unsigned char *subHashArray; // hashes of the sub-blocks
+    int filter;
+    unsigned char *refArray; // last written blocks, reference of the XOR predictor
+    int policy;
+    int nth;
+    bool touched; // hash with next checkpoint (static policy)
+    unsigned int *heatMap; // number of checkpoints each block was dirty
+    size_t nbHeatBlocks;
+    unsigned long nbHashed;
+    unsigned long lastDirtyBlocks;
+    unsigned long totalDirtyBlocks;
+    unsigned char *preHashArray; // hashes of final regions, computed ahead of checkpoint
+    unsigned long *preHashStamp; // stamp of the job that computed the pre-hash
+    unsigned long *modStamp; // stamp of last modification after regionDone
+    size_t nbPreHashBlocks;
+    unsigned long stamp; // incremented for each pre-hash job and modification
+    unsigned long validStamp; // pre-hashes older than this are invalid
 } dataInfo;
 
+typedef struct metaInfo
+{
+    unsigned long fileSize;
+    unsigned long glbDataSize;
+    int fileId;
+    unsigned long blockSize;
+    unsigned long subBlockSize;
+    int nbVar;
+    int varId[BUFF];
+    unsigned long varSize[BUFF];
+    int nbLayers;
+    unsigned long *layerSize;
+    int commSize;
+} metaInfo;
+
+typedef struct fileLoad
+{
+    int rank;
+    unsigned long size;
+} fileLoad;
+
+typedef struct segmentInfo
+{
+    size_t localIdx;
+    size_t count;
+} segmentInfo;
+
+typedef struct preHashJob
+{
+    int idx;
+    unsigned long first;
+    unsigned long last;
+    unsigned long stamp;
+} preHashJob;
+
+typedef struct preHashInfo
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // new jobs or job done
+    preHashJob *queue; // ring buffer
+    size_t head;
+    size_t nbJobs;
+    size_t maxJobs;
+    bool busy;
+    int busyIdx; // dataset of the running job
+    bool shutdown;
+} preHashInfo;
+
 typedef struct profInfo
 {
     size_t hashArrayCur;
@@ -125,6 +223,12 @@ typedef struct profInfo
 
 char* hashHex( const unsigned char* hash, int digestWidth, char* hashHexStr );
 unsigned char* CRC32( const unsigned char *d, unsigned long nBytes, unsigned char *hash );
+void crc32cInit();
+uint32_t crc32cUpdate( uint32_t crc, const unsigned char *d, unsigned long nBytes );
+void shuffleInit();
+void shuffle( const unsigned char *src, unsigned char *dst, unsigned long nBytes, size_t elemSize );
+void unshuffle( const unsigned char *src, unsigned char *dst, unsigned long nBytes, size_t elemSize );
+void xorBlock( unsigned char *dst, const unsigned char *src, unsigned long nBytes );
 int registerEnvironment( confInfo * Conf, execInfo * Exec );
 void printConfiguration( confInfo Conf, execInfo Exec );
 unsigned long timestamp();
@@ -1,13 +1,207 @@
 #include <mpi.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "dcp_lib.h"
 
 #define BLOCKSIZE 16384L
 #define ELEM_PER_BLOCK (BLOCKSIZE/sizeof(int))
 #define SIZE_IN_BLOCKS( NUM ) (NUM*ELEM_PER_BLOCK)
 
-int main() {
+// filtered datasets: double and float use the SSSE3 shuffle, 12 byte vectors the generic one.
+// All end with a partial block and a tail that is not a multiple of 16 elements.
+#define NB_FILTERED 3
+static const int filteredId[NB_FILTERED] = { 2, 3, 4 };
+static const size_t filteredElemSize[NB_FILTERED] = { sizeof(double), sizeof(float), 3*sizeof(float) };
+static const unsigned long filteredNelems[NB_FILTERED] = { 37*BLOCKSIZE/sizeof(double) + 1013, 23*BLOCKSIZE/sizeof(float) + 1013, 3001 };
+
+// value of element 'i' after 'step' modifications, each changing a few elements in every third block.
+static double filteredValue( int rank, unsigned long i, size_t elemSize, int step )
+{
+    double v = rank*1e6 + i*0.25;
+    int s;
+    for(s=1; s<=step; s++) {
+        if( ((i*elemSize/BLOCKSIZE) % 3 == s % 3) && (i % 5 == 0) ) v += s/3.0;
+    }
+    return v;
+}
+
+// datasets with checkpoint policies, state 's' changes the blocks with (block % 4) < s.
+#define STATIC_ID 5
+#define NTH_ID 6
+#define POLICY_NELEMS (SIZE_IN_BLOCKS(16) + ELEM_PER_BLOCK/2)
+
+static void fillPolicy( int *ptr, int rank, int state )
+{
+    unsigned long i;
+    for(i=0; i<POLICY_NELEMS; i++) {
+        ptr[i] = rank*1000000 + i + ( ((i/ELEM_PER_BLOCK) % 4 < state) ? state*7 : 0 );
+    }
+}
+
+static bool checkPolicy( int *ptr, int rank, int state )
+{
+    int *ref = (int*) malloc( POLICY_NELEMS*sizeof(int) );
+    fillPolicy( ref, rank, state );
+    bool equal = (memcmp( ptr, ref, POLICY_NELEMS*sizeof(int) ) == 0);
+    free(ref);
+    return equal;
+}
+
+// pre-hashed dataset, state 1 changes a few elements in blocks 3 to 10.
+#define PREHASH_ID 7
+#define PREHASH_NELEMS (SIZE_IN_BLOCKS(64) + ELEM_PER_BLOCK/3)
+
+static bool preHashModified( unsigned long i )
+{
+    return (i >= SIZE_IN_BLOCKS(3)) && (i < SIZE_IN_BLOCKS(11)) && (i % 1000 == 0);
+}
+
+static void fillPreHash( int *ptr, int rank, int state )
+{
+    unsigned long i;
+    for(i=0; i<PREHASH_NELEMS; i++) {
+        ptr[i] = rank*1000000 + i + ( (state > 0) && preHashModified( i ) ? 11 : 0 );
+    }
+}
+
+static void fillFiltered( void *ptr, unsigned long nelems, size_t elemSize, int rank, int step )
+{
+    unsigned long i;
+    for(i=0; i<nelems; i++) {
+        double v = filteredValue( rank, i, elemSize, step );
+        if( elemSize == sizeof(double) ) {
+            ((double*)ptr)[i] = v;
+        } else if( elemSize == sizeof(float) ) {
+            ((float*)ptr)[i] = v;
+        } else {
+            float *vec = (float*)ptr + 3*i;
+            vec[0] = v; vec[1] = v+1; vec[2] = -v;
+        }
+    }
+}
+
+// datasets at the end of a run and their content, used to check a restart on a different 
+// number of ranks. 'rank' is the rank of the checkpointed run.
+#define INT_NELEMS (SIZE_IN_BLOCKS(1280L) + SIZE_IN_BLOCKS(1)/2)
+#define NB_RESTART 7
+static const int restartId[NB_RESTART] = { 1, 2, 3, 4, STATIC_ID, NTH_ID, PREHASH_ID };
+static size_t restartChunk[NB_RESTART];
+
+static int restartIndex( int id )
+{
+    int k;
+    for(k=0; k<NB_RESTART; k++) {
+        if( restartId[k] == id ) break;
+    }
+    return k;
+}
+
+static int filteredIndex( int id )
+{
+    int k;
+    for(k=0; k<NB_FILTERED; k++) {
+        if( filteredId[k] == id ) break;
+    }
+    return k;
+}
+
+static void restartSize( int id, size_t *elemSize, unsigned long *nelems )
+{
+    if( id == 1 ) {
+        *elemSize = sizeof(int);
+        *nelems = INT_NELEMS;
+    } else if( (id == STATIC_ID) || (id == NTH_ID) ) {
+        *elemSize = sizeof(int);
+        *nelems = POLICY_NELEMS;
+    } else if( id == PREHASH_ID ) {
+        *elemSize = sizeof(int);
+        *nelems = PREHASH_NELEMS;
+    } else {
+        *elemSize = filteredElemSize[filteredIndex( id )];
+        *nelems = filteredNelems[filteredIndex( id )];
+    }
+}
+
+static void fillRestart( int id, void *ptr, int rank )
+{
+    unsigned long i;
+    if( id == 1 ) {
+        // global index + 1
+        for(i=0; i<INT_NELEMS; i++) {
+            ((int*)ptr)[i] = rank*INT_NELEMS + i + 1;
+        }
+    } else if( id == STATIC_ID ) {
+        fillPolicy( (int*)ptr, rank, 2 );
+    } else if( id == NTH_ID ) {
+        fillPolicy( (int*)ptr, rank, 1 );
+    } else if( id == PREHASH_ID ) {
+        fillPreHash( (int*)ptr, rank, 1 );
+    } else {
+        int k = filteredIndex( id );
+        fillFiltered( ptr, filteredNelems[k], filteredElemSize[k], rank, 5 );
+    }
+}
+
+// contiguous blocks of the global datasets
+static void blockPartition( int id, size_t globalIdx, int *rank, size_t *localIdx, size_t *count )
+{
+    size_t chunk = restartChunk[restartIndex( id )];
+    *rank = globalIdx / chunk;
+    *localIdx = globalIdx % chunk;
+    *count = chunk - *localIdx;
+}
+
+static bool restart( const char *execId, int oldSize )
+{
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank); 
+    MPI_Comm_size(MPI_COMM_WORLD, &size); 
+    
+    void *ptr[NB_RESTART];
+    size_t elemSize[NB_RESTART];
+    unsigned long nelems[NB_RESTART], first[NB_RESTART], last[NB_RESTART];
+    int k;
+    for(k=0; k<NB_RESTART; k++) {
+        restartSize( restartId[k], &elemSize[k], &nelems[k] );
+        unsigned long glbNelems = oldSize*nelems[k];
+        restartChunk[k] = (glbNelems + size - 1) / size;
+        first[k] = ( rank*restartChunk[k] < glbNelems ) ? rank*restartChunk[k] : glbNelems;
+        last[k] = ( first[k] + restartChunk[k] < glbNelems ) ? first[k] + restartChunk[k] : glbNelems;
+        ptr[k] = calloc( last[k] - first[k] + 1, elemSize[k] );
+        protect( restartId[k], ptr[k], last[k] - first[k], elemSize[k] );
+        if( filteredIndex( restartId[k] ) < NB_FILTERED ) {
+            setFilter( restartId[k], DCP_FILTER_SHUFFLE | DCP_FILTER_XOR );
+        }
+    }
+    
+    bool success = (recoverFrom( execId, blockPartition ) == 0);
+    
+    for(k=0; k<NB_RESTART; k++) {
+        unsigned char *ref = (unsigned char*) malloc( nelems[k]*elemSize[k] );
+        int refRank = -1;
+        unsigned long g;
+        for(g=first[k]; success && g<last[k]; g++) {
+            if( g/nelems[k] != refRank ) {
+                refRank = g/nelems[k];
+                fillRestart( restartId[k], ref, refRank );
+            }
+            success &= (memcmp( (unsigned char*)ptr[k] + (g-first[k])*elemSize[k], ref + (g%nelems[k])*elemSize[k], elemSize[k] ) == 0);
+        }
+        free(ref);
+    }
+    MPI_Allreduce( MPI_IN_PLACE, &success, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD );
+    
+    if(rank==0) printf( "[%s] (restart) -> %d datasets from %d on %d ranks\n", (success)?"SUCCESS":"FAILURE", NB_RESTART, oldSize, size );
+    
+    for(k=0; k<NB_RESTART; k++) {
+        free(ptr[k]);
+    }
+    
+    return success;
+}
+
+int main( int argc, char *argv[] ) {
 
     MPI_Init(NULL,NULL);
 
@@ -16,6 +210,14 @@ int main() {
     int rank; 
     MPI_Comm_rank(MPI_COMM_WORLD, &rank); 
     
+    // app.e <execution id> <number of ranks> restarts from an earlier run
+    if( argc == 3 ) {
+        bool success = restart( argv[1], atoi(argv[2]) );
+        finalize();
+        MPI_Finalize();
+        exit( (success) ? EXIT_SUCCESS : EXIT_FAILURE );
+    }
+    
     unsigned long  nelems = SIZE_IN_BLOCKS(1024L) + SIZE_IN_BLOCKS(1)/2;
     //unsigned long  nelems = SIZE_IN_BLOCKS(1024L/16L*1024L) + SIZE_IN_BLOCKS(1)/2;
     unsigned long  size = nelems * sizeof(int);
@@ -88,6 +290,171 @@ int main() {
     bool success = (check == check_cmpt);
     
     if(rank==0) printf( "[%s] -> check:[%lu|%lu]\n", (success)?"SUCCESS":"FAILURE", check, check_cmpt );
+    
+    // increase size within the stack, base layer holds the smaller dataset
+    nelems_old = nelems;
+    nelems += SIZE_IN_BLOCKS(256);
+    size = nelems * sizeof(int);
+    data = (int*) realloc( data, size );
+    for(i=nelems_old; i<nelems; i++) {
+        data[i] = i+1;
+    }
+    protect( 1, data, nelems, sizeof(int) );
+    
+    checkpoint( 8 );
+
+    memset(data, 0x0, size);
+
+    int rc = recover();
+
+    check = 0;
+    for(i=0; i<nelems; i++) {
+        check += data[i];
+    }
+
+    check_cmpt = ((nelems*(nelems+1))/2);
+
+    success = (rc == 0) && (check == check_cmpt);
+    
+    if(rank==0) printf( "[%s] (resized) -> check:[%lu|%lu]\n", (success)?"SUCCESS":"FAILURE", check, check_cmpt );
+    
+    // filtered datasets, modified in several layers (checkpoint 10 starts a new stack)
+    void *filtered[NB_FILTERED], *filteredRef[NB_FILTERED];
+    int k, step;
+    for(k=0; k<NB_FILTERED; k++) {
+        filtered[k] = malloc( filteredNelems[k]*filteredElemSize[k] );
+        fillFiltered( filtered[k], filteredNelems[k], filteredElemSize[k], rank, 0 );
+        protect( filteredId[k], filtered[k], filteredNelems[k], filteredElemSize[k] );
+        setFilter( filteredId[k], DCP_FILTER_SHUFFLE | DCP_FILTER_XOR );
+    }
+    for(step=1; step<=4; step++) {
+        checkpoint( 8+step );
+        for(k=0; k<NB_FILTERED; k++) {
+            fillFiltered( filtered[k], filteredNelems[k], filteredElemSize[k], rank, step );
+        }
+    }
+    checkpoint( 13 );
+    
+    for(k=0; k<NB_FILTERED; k++) {
+        filteredRef[k] = malloc( filteredNelems[k]*filteredElemSize[k] );
+        memcpy( filteredRef[k], filtered[k], filteredNelems[k]*filteredElemSize[k] );
+        memset( filtered[k], 0x0, filteredNelems[k]*filteredElemSize[k] );
+    }
+
+    rc = recover();
+
+    success = (rc == 0);
+    for(k=0; k<NB_FILTERED; k++) {
+        success &= (memcmp( filtered[k], filteredRef[k], filteredNelems[k]*filteredElemSize[k] ) == 0);
+        free(filteredRef[k]);
+    }
+    MPI_Allreduce( MPI_IN_PLACE, &success, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD );
+    
+    if(rank==0) printf( "[%s] (filtered) -> bit-exact recovery of %d datasets\n", (success)?"SUCCESS":"FAILURE", NB_FILTERED );
+    
+    // static dataset is only written with the base (checkpoint 15) and after touch(), the 
+    // nth dataset every 2nd checkpoint (checkpoint 16 but not 17).
+    int *staticData = (int*) malloc( POLICY_NELEMS*sizeof(int) );
+    int *nthData = (int*) malloc( POLICY_NELEMS*sizeof(int) );
+    fillPolicy( staticData, rank, 0 );
+    fillPolicy( nthData, rank, 0 );
+    protect( STATIC_ID, staticData, POLICY_NELEMS, sizeof(int) );
+    protect( NTH_ID, nthData, POLICY_NELEMS, sizeof(int) );
+    setPolicy( STATIC_ID, DCP_POLICY_STATIC, 0 );
+    setPolicy( NTH_ID, DCP_POLICY_NTH, 2 );
+    
+    checkpoint( 14 );
+    checkpoint( 15 ); // layer 0
+    
+    // not reported by touch(), lost on recovery
+    fillPolicy( staticData, rank, 1 );
+    fillPolicy( nthData, rank, 1 );
+    checkpoint( 16 );
+    
+    fillPolicy( nthData, rank, 2 );
+    checkpoint( 17 );
+    
+    dcpVarStats staticStats, nthStats;
+    getVarStats( STATIC_ID, &staticStats );
+    getVarStats( NTH_ID, &nthStats );
+    unsigned int *heatMap = (unsigned int*) malloc( sizeof(unsigned int)*nthStats.nbBlocks );
+    long nbHeat = getHeatMap( NTH_ID, heatMap, nthStats.nbBlocks );
+    unsigned long heat = 0;
+    for(j=0; j<nbHeat; j++) {
+        heat += heatMap[j];
+    }
+    free(heatMap);
+    
+    // static hashed with 14 only, nth with 14, 15 and 16; 5 blocks changed with 16
+    success = (staticStats.nbHashed == 1) && (nthStats.nbHashed == 3) && (nthStats.lastDirtyBlocks == 5)
+        && (nbHeat == nthStats.nbBlocks) && (heat == nthStats.totalDirtyBlocks);
+    
+    memset( staticData, 0x0, POLICY_NELEMS*sizeof(int) );
+    memset( nthData, 0x0, POLICY_NELEMS*sizeof(int) );
+
+    rc = recover();
+    
+    success &= (rc == 0) && checkPolicy( staticData, rank, 0 ) && checkPolicy( nthData, rank, 1 );
+    
+    fillPolicy( staticData, rank, 2 );
+    touch( STATIC_ID );
+    checkpoint( 18 );
+    
+    memset( staticData, 0x0, POLICY_NELEMS*sizeof(int) );
+
+    rc = recover();
+    
+    getVarStats( STATIC_ID, &staticStats );
+    success &= (rc == 0) && checkPolicy( staticData, rank, 2 ) && (staticStats.nbHashed == 2);
+    MPI_Allreduce( MPI_IN_PLACE, &success, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD );
+    
+    if(rank==0) printf( "[%s] (policies) -> static and nth datasets, statistics\n", (success)?"SUCCESS":"FAILURE" );
+    
+    // pre-hashed dataset, written after regionDone() and reported with regionModified()
+    int *preHashData = (int*) malloc( PREHASH_NELEMS*sizeof(int) );
+    int *preHashRef = (int*) malloc( PREHASH_NELEMS*sizeof(int) );
+    fillPreHash( preHashData, rank, 0 );
+    protect( PREHASH_ID, preHashData, PREHASH_NELEMS, sizeof(int) );
+    
+    checkpoint( 19 );
+    checkpoint( 20 ); // layer 0
+    
+    // the block holding the split is not pre-hashed
+    unsigned long half = PREHASH_NELEMS/2 + 7;
+    regionDone( PREHASH_ID, 0, half*sizeof(int) );
+    regionDone( PREHASH_ID, half*sizeof(int), (PREHASH_NELEMS-half)*sizeof(int) );
+    for(j=0; j<PREHASH_NELEMS; j++) {
+        if( preHashModified( j ) ) {
+            preHashData[j] += 11;
+            regionModified( PREHASH_ID, j*sizeof(int), sizeof(int) );
+        }
+    }
+    checkpoint( 21 );
+    
+    memset( preHashData, 0x0, PREHASH_NELEMS*sizeof(int) );
+
+    rc = recover();
+    
+    fillPreHash( preHashRef, rank, 1 );
+    success = (rc == 0) && (memcmp( preHashData, preHashRef, PREHASH_NELEMS*sizeof(int) ) == 0);
+    free(preHashRef);
+    MPI_Allreduce( MPI_IN_PLACE, &success, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD );
+    
+    if(rank==0) printf( "[%s] (pre-hash) -> writes reported after regionDone()\n", (success)?"SUCCESS":"FAILURE" );
+    
+    // final content for the restart, the last checkpoint is a layer
+    checkpoint( 22 );
+    fillRestart( 1, data, rank );
+    for(k=0; k<NB_FILTERED; k++) {
+        fillRestart( filteredId[k], filtered[k], rank );
+    }
+    checkpoint( 23 );
+    
+    int nbRanks;
+    MPI_Comm_size(MPI_COMM_WORLD, &nbRanks); 
+    if(rank==0) printf( "[INFO] restart with 'app.e <execution id> %d'\n", nbRanks );
+    
+    finalize();
     MPI_Finalize();
 
     exit(EXIT_SUCCESS);
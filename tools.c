@@ -23,6 +23,240 @@ unsigned char* CRC32( const unsigned char *d, unsigned long nBytes, unsigned cha
     return hash;
 }
 
+// CRC32C (Castagnoli) used for the integrity checks of the checkpoint files.
+// Uses the SSE4.2 (x86) or ARMv8 CRC instructions if available, a lookup table otherwise.
+static uint32_t crc32cTable[256];
+static bool crc32cHw = false;
+
+void crc32cInit()
+{
+    uint32_t i, j;
+    for(i=0; i<256; i++) {
+        uint32_t crc = i;
+        for(j=0; j<8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : (crc >> 1);
+        }
+        crc32cTable[i] = crc;
+    }
+#if defined(__x86_64__)
+    crc32cHw = __builtin_cpu_supports( "sse4.2" );
+#elif defined(__ARM_FEATURE_CRC32)
+    crc32cHw = true;
+#endif
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHwUpdate( uint32_t crc, const unsigned char *d, unsigned long nBytes )
+{
+    uint64_t crc64 = crc;
+    for(; nBytes >= 8; nBytes -= 8, d += 8) {
+        uint64_t word;
+        memcpy( &word, d, 8 );
+        crc64 = _mm_crc32_u64( crc64, word );
+    }
+    crc = (uint32_t) crc64;
+    for(; nBytes > 0; nBytes--, d++) {
+        crc = _mm_crc32_u8( crc, *d );
+    }
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHwUpdate( uint32_t crc, const unsigned char *d, unsigned long nBytes )
+{
+    for(; nBytes >= 8; nBytes -= 8, d += 8) {
+        uint64_t word;
+        memcpy( &word, d, 8 );
+        crc = __crc32cd( crc, word );
+    }
+    for(; nBytes > 0; nBytes--, d++) {
+        crc = __crc32cb( crc, *d );
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32cUpdate( uint32_t crc, const unsigned char *d, unsigned long nBytes )
+{
+    crc = ~crc;
+#if defined(__x86_64__) || defined(__ARM_FEATURE_CRC32)
+    if( crc32cHw ) {
+        return ~crc32cHwUpdate( crc, d, nBytes );
+    }
+#endif
+    for(; nBytes > 0; nBytes--, d++) {
+        crc = crc32cTable[(crc ^ *d) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Byte-shuffle filter: groups the i-th bytes of all elements of a block together.
+// Element sizes 4 and 8 use SSSE3 if available, all others the generic loops.
+static bool shuffleHw = false;
+
+void shuffleInit()
+{
+#if defined(__x86_64__)
+    shuffleHw = __builtin_cpu_supports( "ssse3" );
+#endif
+}
+
+static void shuffleGeneric( const unsigned char *src, unsigned char *dst, unsigned long nElem, size_t elemSize, unsigned long start )
+{
+    unsigned long i;
+    size_t j;
+    for(i=start; i<nElem; i++) {
+        for(j=0; j<elemSize; j++) {
+            dst[j*nElem + i] = src[i*elemSize + j];
+        }
+    }
+}
+
+static void unshuffleGeneric( const unsigned char *src, unsigned char *dst, unsigned long nElem, size_t elemSize, unsigned long start )
+{
+    unsigned long i;
+    size_t j;
+    for(i=start; i<nElem; i++) {
+        for(j=0; j<elemSize; j++) {
+            dst[i*elemSize + j] = src[j*nElem + i];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// transposes 4x4 dwords, self-inverse
+#define TRANSPOSE4_EPI32(R0,R1,R2,R3) do { \
+    __m128i t0_ = _mm_unpacklo_epi32( R0, R1 ); \
+    __m128i t1_ = _mm_unpacklo_epi32( R2, R3 ); \
+    __m128i t2_ = _mm_unpackhi_epi32( R0, R1 ); \
+    __m128i t3_ = _mm_unpackhi_epi32( R2, R3 ); \
+    R0 = _mm_unpacklo_epi64( t0_, t1_ ); \
+    R1 = _mm_unpackhi_epi64( t0_, t1_ ); \
+    R2 = _mm_unpacklo_epi64( t2_, t3_ ); \
+    R3 = _mm_unpackhi_epi64( t2_, t3_ ); \
+} while (0)
+
+// transposes 8x8 words, self-inverse
+static void transpose8Epi16( __m128i *r )
+{
+    __m128i t[8], u[8];
+    int k;
+    for(k=0; k<4; k++) {
+        t[2*k]   = _mm_unpacklo_epi16( r[2*k], r[2*k+1] );
+        t[2*k+1] = _mm_unpackhi_epi16( r[2*k], r[2*k+1] );
+    }
+    for(k=0; k<2; k++) {
+        u[4*k]   = _mm_unpacklo_epi32( t[4*k],   t[4*k+2] );
+        u[4*k+1] = _mm_unpackhi_epi32( t[4*k],   t[4*k+2] );
+        u[4*k+2] = _mm_unpacklo_epi32( t[4*k+1], t[4*k+3] );
+        u[4*k+3] = _mm_unpackhi_epi32( t[4*k+1], t[4*k+3] );
+    }
+    for(k=0; k<4; k++) {
+        r[2*k]   = _mm_unpacklo_epi64( u[k], u[k+4] );
+        r[2*k+1] = _mm_unpackhi_epi64( u[k], u[k+4] );
+    }
+}
+
+// processes 16 elements per iteration, returns number of elements processed
+__attribute__((target("ssse3")))
+static unsigned long shuffleHwBlock( const unsigned char *src, unsigned char *dst, unsigned long nElem, size_t elemSize, bool inverse )
+{
+    unsigned long i = 0;
+    if( elemSize == 4 ) {
+        const __m128i mask = _mm_setr_epi8( 0,4,8,12, 1,5,9,13, 2,6,10,14, 3,7,11,15 );
+        for(; i+16 <= nElem; i+=16) {
+            __m128i r[4];
+            int k;
+            if( !inverse ) {
+                for(k=0; k<4; k++) {
+                    r[k] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(src + i*4 + 16*k) ), mask );
+                }
+                TRANSPOSE4_EPI32( r[0], r[1], r[2], r[3] );
+                for(k=0; k<4; k++) {
+                    _mm_storeu_si128( (__m128i*)(dst + k*nElem + i), r[k] );
+                }
+            } else {
+                for(k=0; k<4; k++) {
+                    r[k] = _mm_loadu_si128( (const __m128i*)(src + k*nElem + i) );
+                }
+                TRANSPOSE4_EPI32( r[0], r[1], r[2], r[3] );
+                for(k=0; k<4; k++) {
+                    _mm_storeu_si128( (__m128i*)(dst + i*4 + 16*k), _mm_shuffle_epi8( r[k], mask ) );
+                }
+            }
+        }
+    } else if( elemSize == 8 ) {
+        const __m128i mask = _mm_setr_epi8( 0,8, 1,9, 2,10, 3,11, 4,12, 5,13, 6,14, 7,15 );
+        const __m128i imask = _mm_setr_epi8( 0,2,4,6,8,10,12,14, 1,3,5,7,9,11,13,15 );
+        for(; i+16 <= nElem; i+=16) {
+            __m128i r[8];
+            int k;
+            if( !inverse ) {
+                for(k=0; k<8; k++) {
+                    r[k] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(src + i*8 + 16*k) ), mask );
+                }
+                transpose8Epi16( r );
+                for(k=0; k<8; k++) {
+                    _mm_storeu_si128( (__m128i*)(dst + k*nElem + i), r[k] );
+                }
+            } else {
+                for(k=0; k<8; k++) {
+                    r[k] = _mm_loadu_si128( (const __m128i*)(src + k*nElem + i) );
+                }
+                transpose8Epi16( r );
+                for(k=0; k<8; k++) {
+                    _mm_storeu_si128( (__m128i*)(dst + i*8 + 16*k), _mm_shuffle_epi8( r[k], imask ) );
+                }
+            }
+        }
+    }
+    return i;
+}
+#endif
+
+void shuffle( const unsigned char *src, unsigned char *dst, unsigned long nBytes, size_t elemSize )
+{
+    unsigned long nElem = nBytes / elemSize;
+    unsigned long start = 0;
+#if defined(__x86_64__)
+    if( shuffleHw ) {
+        start = shuffleHwBlock( src, dst, nElem, elemSize, false );
+    }
+#endif
+    shuffleGeneric( src, dst, nElem, elemSize, start );
+    // trailing bytes that do not form a whole element
+    memcpy( dst + nElem*elemSize, src + nElem*elemSize, nBytes - nElem*elemSize );
+}
+
+void unshuffle( const unsigned char *src, unsigned char *dst, unsigned long nBytes, size_t elemSize )
+{
+    unsigned long nElem = nBytes / elemSize;
+    unsigned long start = 0;
+#if defined(__x86_64__)
+    if( shuffleHw ) {
+        start = shuffleHwBlock( src, dst, nElem, elemSize, true );
+    }
+#endif
+    unshuffleGeneric( src, dst, nElem, elemSize, start );
+    memcpy( dst + nElem*elemSize, src + nElem*elemSize, nBytes - nElem*elemSize );
+}
+
+// dst ^= src
+void xorBlock( unsigned char *dst, const unsigned char *src, unsigned long nBytes )
+{
+    unsigned long i = 0;
+#if defined(__x86_64__)
+    for(; i+16 <= nBytes; i+=16) {
+        __m128i a = _mm_loadu_si128( (const __m128i*)(dst + i) );
+        __m128i b = _mm_loadu_si128( (const __m128i*)(src + i) );
+        _mm_storeu_si128( (__m128i*)(dst + i), _mm_xor_si128( a, b ) );
+    }
+#endif
+    for(; i<nBytes; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
 MSTRM* mcreate( void** ptr, size_t size ) {
     
     if( size == 0 ) {
@@ -125,12 +359,18 @@ void printConfiguration( confInfo Conf, execInfo Exec )
             "number of processes per node: \t%d\n"
             "number of nodes: \t\t%d\n"
             "dcp hashing method: \t\t%s\n"
+            "dcp block size: \t\t%lu\n"
+            "dcp sub-block size: \t\t%lu\n"
+            "background pre-hashing: \t%s\n"
             "## CONFIGURATION ##\n",
             Exec.id, 
             Exec.commSize, 
             Exec.nodeSize,
             Exec.commSize / Exec.nodeSize,
-            (Conf.digestWidth==MD5_DIGEST_LENGTH)?"MD5":"CRC32"
+            (Conf.digestWidth==MD5_DIGEST_LENGTH)?"MD5":"CRC32",
+            Conf.dcpBlockSize,
+            Conf.dcpSubBlockSize,
+            (Conf.preHashThread)?"yes":"no"
           );
 }
 
@@ -152,6 +392,25 @@ int registerEnvironment( confInfo *Conf, execInfo *Exec )
         Conf->hashFunc = MD5;
         Conf->digestWidth = MD5_DIGEST_LENGTH;
     }
+    if( (envString = getenv("DCP_SUBBLOCK_SIZE")) != 0 ) {
+        Conf->dcpSubBlockSize = strtoul( envString, NULL, 10 );
+    } else {
+        Conf->dcpSubBlockSize = 512;
+    }
+    if( (envString = getenv("DCP_MTBF")) != 0 ) {
+        Conf->mtbf = strtod( envString, NULL );
+        if( Conf->mtbf <= 0 ) {
+            ERR_MSG( MPI_COMM_WORLD, "'DCP_MTBF' has to be a positive number of seconds", -1 );
+            return NSCS;
+        }
+    } else {
+        Conf->mtbf = 0;
+    }
+    if( (envString = getenv("DCP_PREHASH_THREAD")) != 0 ) {
+        Conf->preHashThread = (atoi(envString) != 0);
+    } else {
+        Conf->preHashThread = false;
+    }
     if( (envString = getenv("NODE_SIZE")) != 0 ) {
         if( Exec->commSize%atoi(envString) != 0 ) {
             ERR_MSG( MPI_COMM_WORLD, "Number of processes '%d' has to be a multiple of the nodesize '%d'", Exec->commRank, Exec->commSize, atoi(envString) );